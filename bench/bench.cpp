@@ -0,0 +1,473 @@
+#include "llama2.h"
+#include "pipeline.h"
+#include "generator.h"
+#include "sampler.h"
+#include "encoder/bpe.h"
+#include "dispatch.h"
+#include "synthetic.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+// ----------------------------------------------------------------------------
+// Microbenchmarks of the hot paths on random-weight models. Prints JSON, one
+// entry per benchmark with the time per iteration and the achieved GFLOP/s
+// and GB/s, so regressions can be tracked on any machine without a real model.
+//
+//   tinyinference-bench [--config dim,hidden_dim,n_layers,n_heads,n_kv_heads,vocab_size,seq_len]...
+//                       [--min-time seconds] [--filter substring] [--out file]
+
+struct bench_result {
+    std::string name;
+    std::string config;
+    std::string params;
+    long iters;
+    double ns_per_iter;
+    double gflops;
+    double gbps;
+};
+
+struct bench_options {
+    double min_time = 0.25;  // seconds each benchmark runs for, at least
+    std::string filter;      // only run benchmarks whose name contains this
+};
+
+static std::vector<bench_result> results;
+static bench_options options;
+
+static std::string config_name(const Config& c) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%dx%dx%dx%dx%dx%dx%d", c.dim, c.hidden_dim, c.n_layers,
+             c.n_heads, c.n_kv_heads, c.vocab_size, c.seq_len);
+    return buf;
+}
+
+static const char* dtype_name(dtype type) {
+    switch (type) {
+        case dtype::f16: return "f16";
+        case dtype::bf16: return "bf16";
+        default: return "f32";
+    }
+}
+
+// run fn until min_time has passed (after one warmup call) and record the rates
+static void run(const std::string& name, const Config& config, const std::string& params,
+                double flops_per_iter, double bytes_per_iter, const std::function<void()>& fn) {
+    if (!options.filter.empty() && name.find(options.filter) == std::string::npos) {
+        return;
+    }
+
+    fn();
+
+    using clock = std::chrono::steady_clock;
+    long iters = 0;
+    auto start = clock::now();
+    double elapsed = 0.0;
+    do {
+        fn();
+        iters++;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    } while (elapsed < options.min_time || iters < 3);
+
+    double seconds = elapsed / iters;
+    results.push_back({name, config_name(config), params, iters, seconds * 1e9,
+                       flops_per_iter / seconds * 1e-9, bytes_per_iter / seconds * 1e-9});
+    fprintf(stderr, "%-16s %-28s %-32s %12.1f ns\n", name.c_str(), config_name(config).c_str(),
+            params.c_str(), seconds * 1e9);
+}
+
+static std::vector<float> random_vector(size_t n, unsigned long long seed, float scale = 1.0f) {
+    std::vector<float> v(n);
+    synthetic_rng rng{seed};
+    fill_random(v, rng, scale);
+    return v;
+}
+
+// ----------------------------------------------------------------------------
+// tensor::operator* for the matrix shapes of one layer and the classifier
+
+static void bench_matmul(const Config& c) {
+    struct shape { const char* what; int n; int k; };
+    int kv_dim = c.dim * c.n_kv_heads / c.n_heads;
+    std::vector<shape> shapes = {
+        {"wq", c.dim, c.dim},
+        {"wk", kv_dim, c.dim},
+        {"w1", c.hidden_dim, c.dim},
+        {"w2", c.dim, c.hidden_dim},
+        {"wcls", c.vocab_size, c.dim},
+    };
+
+    for (const shape& s : shapes) {
+        std::vector<float> w = random_vector((size_t)s.n * s.k, 1, 1.0f / s.k);
+        std::vector<uint16_t> w_half(w.size());
+        std::vector<float> input = random_vector(s.k, 2);
+        tensor x{input.data(), {1, s.k}};
+
+        for (dtype type : {dtype::f32, dtype::f16, dtype::bf16}) {
+            tensor weight;
+            if (type == dtype::f32) {
+                weight = tensor{w.data(), {s.n, s.k}};
+            } else {
+                from_fp32(w_half.data(), w.data(), w.size(), type);
+                weight = tensor{(void*)w_half.data(), {s.n, s.k}, type};
+            }
+
+            char params[96];
+            snprintf(params, sizeof(params), "%s 1x%dx%d %s", s.what, s.n, s.k, dtype_name(type));
+            double flops = 2.0 * s.n * s.k;
+            double bytes = (double)s.n * s.k * dtype_size(type) + (s.k + s.n) * sizeof(float);
+            run("matmul", c, params, flops, bytes, [&] {
+                tensor out = x * weight;
+            });
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// elementwise ops at the sizes the forward pass uses them
+
+static void bench_mathlib(const Config& c) {
+    tensor x{{1, c.dim}};
+    tensor weight{{1, c.dim}, 1.0f};
+    tensor logits{{1, c.vocab_size}};
+    tensor hidden{{1, c.hidden_dim}};
+    std::vector<float> r = random_vector(std::max(c.vocab_size, std::max(c.dim, c.hidden_dim)), 3);
+    memcpy(x.get_data(), r.data(), x.size() * sizeof(float));
+    memcpy(logits.get_data(), r.data(), logits.size() * sizeof(float));
+    memcpy(hidden.get_data(), r.data(), hidden.size() * sizeof(float));
+
+    char params[64];
+    snprintf(params, sizeof(params), "n=%d", c.dim);
+    run("rms_norm", c, params, 4.0 * c.dim, 3.0 * c.dim * sizeof(float), [&] {
+        tensor out = rms_norm(x, weight);
+    });
+
+    snprintf(params, sizeof(params), "n=%d", c.vocab_size);
+    run("softmax", c, params, 4.0 * c.vocab_size, 2.0 * c.vocab_size * sizeof(float), [&] {
+        tensor out = softmax(logits);
+    });
+
+    snprintf(params, sizeof(params), "n=%d", c.hidden_dim);
+    run("silu", c, params, 5.0 * c.hidden_dim, 2.0 * c.hidden_dim * sizeof(float), [&] {
+        tensor out = silu(hidden);
+    });
+}
+
+// ----------------------------------------------------------------------------
+// one transformer layer at growing positions in the sequence
+
+static void bench_attention(const Config& c) {
+    int head_size = c.dim / c.n_heads;
+    int kv_dim = c.n_kv_heads * head_size;
+    std::vector<float> norm(c.dim, 1.0f);
+    std::vector<float> wq = random_vector((size_t)c.dim * c.dim, 4, 1.0f / c.dim);
+    std::vector<float> wk = random_vector((size_t)kv_dim * c.dim, 5, 1.0f / c.dim);
+    std::vector<float> wv = random_vector((size_t)kv_dim * c.dim, 6, 1.0f / c.dim);
+    std::vector<float> wo = random_vector((size_t)c.dim * c.dim, 7, 1.0f / c.dim);
+    std::vector<float> w1 = random_vector((size_t)c.hidden_dim * c.dim, 8, 1.0f / c.dim);
+    std::vector<float> w2 = random_vector((size_t)c.dim * c.hidden_dim, 9, 1.0f / c.hidden_dim);
+    std::vector<float> w3 = random_vector((size_t)c.hidden_dim * c.dim, 10, 1.0f / c.dim);
+
+    attention layer{c};
+    layer.set_rms_att_weight(norm.data());
+    layer.set_query(wq.data());
+    layer.set_key(wk.data());
+    layer.set_value(wv.data());
+    layer.set_weight_o(wo.data());
+    layer.set_rms_ffn_weight(norm.data());
+    layer.set_ffn_weights1(w1.data());
+    layer.set_ffn_weights2(w2.data());
+    layer.set_ffn_weights3(w3.data());
+    layer.fuse_projections();
+
+    std::vector<float> input = random_vector(c.dim, 11);
+    tensor x{input.data(), {1, c.dim}};
+    graph g;
+    g.output(layer.build(g, g.input(x)));
+    g.compile();
+
+    double weight_bytes = (wq.size() + wk.size() + wv.size() + wo.size() + w1.size() + w2.size() + w3.size()) * sizeof(float);
+    double weight_flops = 2.0 * (wq.size() + wk.size() + wv.size() + wo.size() + w1.size() + w2.size() + w3.size());
+
+    std::vector<int> positions = {0, c.seq_len / 4, c.seq_len / 2, c.seq_len - 1};
+    int filled = 0;
+    for (int pos : positions) {
+        // fill the kv cache up to pos, the timed calls then keep rewriting row pos
+        for ( ; filled < pos ; filled++) {
+            g.run(0, filled);
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "pos=%d", pos);
+        double flops = weight_flops + 4.0 * c.n_heads * (pos + 1) * head_size;
+        double bytes = weight_bytes + 2.0 * (pos + 1) * kv_dim * sizeof(float);
+        run("attention", c, params, flops, bytes, [&] {
+            tensor out = g.run(0, pos);
+        });
+    }
+}
+
+// ----------------------------------------------------------------------------
+// the whole model, tokenizer and sampler on files written to a temporary directory
+
+// weights touched by one token
+static size_t params_count(const Config& c) {
+    int head_size = c.dim / c.n_heads;
+    int kv_dim = c.n_kv_heads * head_size;
+    return (size_t)c.vocab_size * c.dim
+         + (size_t)c.n_layers * (2 * c.dim * c.dim + 2 * kv_dim * c.dim + 3 * c.hidden_dim * c.dim);
+}
+
+static void bench_model(const Config& c, const std::string& dir) {
+    for (dtype type : {dtype::f32, dtype::f16, dtype::bf16}) {
+        std::string path = dir + "/model-" + dtype_name(type) + ".bin";
+        write_checkpoint(path, c, type, 12);
+        {
+            llama2 model{&path[0]};
+            model.fuse_projections();
+            size_t params = params_count(c);
+
+            // decode a whole sequence, one iteration is one token
+            int pos = 0;
+            run("forward", c, dtype_name(type), 2.0 * params, (double)params * dtype_size(type), [&] {
+                tensor logits = model.forward(pos % c.vocab_size, pos);
+                pos = (pos + 1) % c.seq_len;
+            });
+
+            // resuming a session of half the context: the caches are mapped back from the
+            // file, then one token runs on them, against the prefill it replaces
+            if (type == dtype::f32) {
+                std::string session_path = dir + "/session.bin";
+                int prefix = c.seq_len / 2;
+                for (int p = 0 ; p < prefix ; p++) {
+                    model.forward(p % c.vocab_size, p);
+                }
+
+                model.save_session(session_path.c_str(), {prefix, 1, 0});
+                char params[64];
+                snprintf(params, sizeof(params), "%s tokens=%d", dtype_name(type), prefix);
+                size_t cache_bytes = (size_t)2 * c.n_layers * prefix * c.n_kv_heads * (c.dim / c.n_heads) * sizeof(float);
+                run("session_restore", c, params, 2.0 * params_count(c), (double)params_count(c) * dtype_size(type) + cache_bytes, [&] {
+                    llama2::session s = model.restore_session(session_path.c_str());
+                    tensor logits = model.forward(s.token, s.pos);
+                });
+                unlink(session_path.c_str());
+            }
+
+            // the same with a LoRA adapter over every projection, applied unmerged; the extra
+            // weights are the low-rank pairs
+            for (int rank : {8, 32}) {
+                if (type != dtype::f32) { continue; }
+                std::string adapter_path = dir + "/adapter.lora";
+                write_adapter(adapter_path, c, rank, 16);
+                llama2 adapted{&path[0]};
+                adapted.fuse_projections();
+                adapted.use_adapter(adapted.load_adapter(adapter_path.c_str()));
+                unlink(adapter_path.c_str());
+
+                int kv_dim = c.n_kv_heads * (c.dim / c.n_heads);
+                size_t lora_params = (size_t)c.n_layers * rank *
+                                     (4 * c.dim + 2 * kv_dim + 2 * c.dim + 3 * (c.dim + c.hidden_dim));
+                char params[64];
+                snprintf(params, sizeof(params), "%s rank=%d", dtype_name(type), rank);
+                pos = 0;
+                run("lora_forward", c, params, 2.0 * (params_count(c) + lora_params),
+                    (double)params_count(c) * dtype_size(type) + lora_params * sizeof(float), [&] {
+                    tensor logits = adapted.forward(pos % c.vocab_size, pos);
+                    pos = (pos + 1) % c.seq_len;
+                });
+            }
+
+            // FFN down projection over the top_k hidden activations only; the quality is the
+            // greedy token agreement and relative logit error against the dense model
+            for (int divisor : {2, 4, 8}) {
+                int top_k = c.hidden_dim / divisor;
+                llama2 sparse{&path[0]};
+                sparse.fuse_projections();
+                sparse.enable_sparse_ffn(-1.0f, top_k);
+                int steps = std::min(c.seq_len, 32);
+                int agree = 0;
+                double err = 0.0;
+                for (int p = 0 ; p < steps ; p++) {
+                    tensor dense_logits = model.forward(p % c.vocab_size, p);
+                    tensor sparse_logits = sparse.forward(p % c.vocab_size, p);
+                    const float* d = dense_logits.get_data();
+                    const float* s = sparse_logits.get_data();
+                    int dense_best = 0, sparse_best = 0;
+                    double diff = 0.0, norm = 0.0;
+                    for (int i = 0 ; i < c.vocab_size ; i++) {
+                        if (d[i] > d[dense_best]) { dense_best = i; }
+                        if (s[i] > s[sparse_best]) { sparse_best = i; }
+                        diff += (d[i] - s[i]) * (d[i] - s[i]);
+                        norm += d[i] * d[i];
+                    }
+                    agree += dense_best == sparse_best;
+                    err += sqrt(diff / norm) / steps;
+                }
+
+                // the down projections read a 1 / divisor of weight2
+                size_t ffn_saved = (size_t)c.n_layers * c.dim * (c.hidden_dim - top_k);
+                char params[96];
+                snprintf(params, sizeof(params), "%s top_k=%d agree=%.2f rel_err=%.2e", dtype_name(type), top_k,
+                         (double)agree / steps, err);
+                pos = 0;
+                run("sparse_ffn", c, params, 2.0 * (params_count(c) - ffn_saved),
+                    (double)(params_count(c) - ffn_saved) * dtype_size(type), [&] {
+                    tensor logits = sparse.forward(pos % c.vocab_size, pos);
+                    pos = (pos + 1) % c.seq_len;
+                });
+            }
+
+            // several sequences through the layers split in stages, one iteration is one
+            // token of every sequence; weights are read once per micro-batch
+            const int n_sequences = 8;
+            const int batch = 2;
+            for (int stages : {1, 2, 4}) {
+                if (type != dtype::f32 || stages > c.n_layers) { continue; }
+                pipeline pipe{model, stages, n_sequences, batch};
+                std::vector<int> tokens(n_sequences);
+                std::vector<int> positions(n_sequences, 0);
+                char params[64];
+                snprintf(params, sizeof(params), "%s stages=%d seqs=%d batch=%d", dtype_name(type), stages, n_sequences, batch);
+                run("pipeline", c, params, 2.0 * params_count(c) * n_sequences,
+                    (double)params_count(c) * dtype_size(type) * n_sequences / batch, [&] {
+                    for (int i = 0 ; i < n_sequences ; i++) {
+                        tokens[i] = (positions[i] + i) % c.vocab_size;
+                    }
+
+                    pipe.step(tokens, positions);
+                    for (int& p : positions) { p = (p + 1) % c.seq_len; }
+                });
+            }
+
+            // n completions of one prompt: the prompt runs once, the branches share its
+            // kv cache and decode as one batch, so weights are read once per step
+            const int prompt_length = std::min(8, c.seq_len / 2);
+            const int completion_length = std::min(16, c.seq_len - prompt_length);
+            std::vector<int> prompt(prompt_length);
+            for (int i = 0 ; i < prompt_length ; i++) { prompt[i] = (i * 7 + 2) % c.vocab_size; }
+            for (int n : {1, 4, 8}) {
+                if (type != dtype::f32) { continue; }
+                generator gen{model, n};
+                char params[64];
+                snprintf(params, sizeof(params), "%s branches=%d prompt=%d steps=%d", dtype_name(type), n,
+                         prompt_length, completion_length);
+                run("branches", c, params, 2.0 * params_count(c) * (prompt_length + n * completion_length),
+                    (double)params_count(c) * dtype_size(type) * (prompt_length + completion_length), [&] {
+                    gen.prefill(prompt);
+                    std::vector<std::vector<int>> completions = gen.sample(n, completion_length, 1.0f, 1.0f, 15);
+                });
+            }
+        }
+
+        unlink(path.c_str());
+    }
+
+    std::string tokenizer_path = dir + "/tokenizer.bin";
+    write_tokenizer(tokenizer_path, c.vocab_size);
+    bpe tokenizer{tokenizer_path, c.vocab_size};
+    unlink(tokenizer_path.c_str());
+
+    const char* words[] = {"the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "and", "then", "naps"};
+    for (size_t length : {64, 1024}) {
+        std::string text;
+        for (size_t i = 0 ; text.size() < length ; i++) {
+            text += words[(i * 7) % 11];
+            text += ' ';
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "bytes=%zu", text.size());
+        run("bpe_encode", c, params, 0.0, text.size(), [&] {
+            std::vector<int> tokens = tokenizer.encode(text, 1, 0);
+        });
+    }
+
+    std::vector<float> values = random_vector(c.vocab_size, 13, 4.0f);
+    for (float temperature : {0.0f, 1.0f}) {
+        for (float topp : {1.0f, 0.9f}) {
+            if (temperature == 0.0f && topp != 1.0f) { continue; }
+            Sampler sampler{c.vocab_size, temperature, topp, 14};
+            char params[64];
+            snprintf(params, sizeof(params), "temperature=%.1f topp=%.1f", temperature, topp);
+            run("sample", c, params, 0.0, c.vocab_size * sizeof(float), [&] {
+                tensor logits{{1, c.vocab_size}};
+                memcpy(logits.get_data(), values.data(), values.size() * sizeof(float));
+                sampler.sample(logits);
+            });
+        }
+    }
+}
+
+static void write_json(FILE* out) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"isa\": \"%s\",\n", kernels().name);
+    fprintf(out, "  \"min_time\": %g,\n", options.min_time);
+    fprintf(out, "  \"results\": [\n");
+    for (size_t i = 0 ; i < results.size() ; i++) {
+        const bench_result& r = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"config\": \"%s\", \"params\": \"%s\", \"iters\": %ld, "
+                     "\"ns_per_iter\": %.1f, \"gflops\": %.4f, \"gbps\": %.4f}%s\n",
+                r.name.c_str(), r.config.c_str(), r.params.c_str(), r.iters, r.ns_per_iter,
+                r.gflops, r.gbps, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [--config dim,hidden_dim,n_layers,n_heads,n_kv_heads,vocab_size,seq_len]...\n"
+                    "          [--min-time seconds] [--filter substring] [--out file]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<Config> configs;
+    const char* out_path = nullptr;
+
+    for (int i = 1 ; i < argc ; i++) {
+        if (i + 1 >= argc) { usage(argv[0]); }
+        if (strcmp(argv[i], "--config") == 0) {
+            Config c;
+            if (sscanf(argv[++i], "%d,%d,%d,%d,%d,%d,%d", &c.dim, &c.hidden_dim, &c.n_layers,
+                       &c.n_heads, &c.n_kv_heads, &c.vocab_size, &c.seq_len) != 7) { usage(argv[0]); }
+            configs.push_back(c);
+        } else if (strcmp(argv[i], "--min-time") == 0) {
+            options.min_time = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0) {
+            options.filter = argv[++i];
+        } else if (strcmp(argv[i], "--out") == 0) {
+            out_path = argv[++i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (configs.empty()) {
+        // the shape of the stories15M model
+        configs.push_back({288, 768, 6, 6, 6, 32000, 256});
+    }
+
+    char dir[] = "/tmp/tinyinference-bench-XXXXXX";
+    if (mkdtemp(dir) == nullptr) { fprintf(stderr, "Couldn't create a temporary directory\n"); return EXIT_FAILURE; }
+
+    for (const Config& c : configs) {
+        bench_matmul(c);
+        bench_mathlib(c);
+        bench_attention(c);
+        bench_model(c, dir);
+    }
+
+    rmdir(dir);
+
+    FILE* out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) { fprintf(stderr, "Couldn't open %s\n", out_path); return EXIT_FAILURE; }
+    write_json(out);
+    if (out != stdout) { fclose(out); }
+    return 0;
+}
@@ -0,0 +1,165 @@
+#include "config.h"
+#include "half.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// ----------------------------------------------------------------------------
+// Random-weight checkpoints and tokenizers, so the benchmarks run anywhere
+// without downloading a model.
+
+struct synthetic_rng {
+    unsigned long long state;
+
+    float next() {
+        // xorshift, uniform in [-1, 1)
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return ((state * 0x2545F4914F6CDD1Dull) >> 40) / 8388608.0f - 1.0f;
+    }
+};
+
+static void fill_random(std::vector<float>& v, synthetic_rng& rng, float scale) {
+    for (float& x : v) {
+        x = rng.next() * scale;
+    }
+}
+
+// write n values, either as fp32 or converted to a half precision type
+static void write_values(FILE* file, const std::vector<float>& v, dtype type) {
+    if (type == dtype::f32) {
+        fwrite(v.data(), sizeof(float), v.size(), file);
+        return;
+    }
+
+    std::vector<uint16_t> half(v.size());
+    from_fp32(half.data(), v.data(), v.size(), type);
+    fwrite(half.data(), sizeof(uint16_t), half.size(), file);
+}
+
+// checkpoint in the llama2.c layout (with the dtype header for half precision types)
+static void write_checkpoint(const std::string& path, Config config, dtype type, unsigned long long seed) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) { fprintf(stderr, "Couldn't create %s\n", path.c_str()); exit(EXIT_FAILURE); }
+
+    if (type != dtype::f32) {
+        CheckpointHeader header{CHECKPOINT_MAGIC, CHECKPOINT_VERSION, (int)type};
+        fwrite(&header, sizeof(CheckpointHeader), 1, file);
+    }
+
+    fwrite(&config, sizeof(Config), 1, file); // positive vocab_size: classifier shared with the embedding
+
+    synthetic_rng rng{seed};
+    int head_size = config.dim / config.n_heads;
+    int kv_dim = config.n_kv_heads * head_size;
+    size_t layers = config.n_layers;
+    auto weights = [&](size_t n, float scale) {
+        std::vector<float> v(n);
+        fill_random(v, rng, scale);
+        write_values(file, v, type);
+    };
+    auto ones = [&](size_t n) {
+        write_values(file, std::vector<float>(n, 1.0f), type);
+    };
+
+    float scale = 1.0f / config.dim;
+    weights((size_t)config.vocab_size * config.dim, 1.0f);
+    ones(layers * config.dim);
+    weights(layers * config.dim * config.dim, scale);
+    weights(layers * kv_dim * config.dim, scale);
+    weights(layers * kv_dim * config.dim, scale);
+    weights(layers * config.dim * config.dim, scale);
+    ones(layers * config.dim);
+    weights(layers * config.hidden_dim * config.dim, scale);
+    weights(layers * config.dim * config.hidden_dim, 1.0f / config.hidden_dim);
+    weights(layers * config.hidden_dim * config.dim, scale);
+    ones(config.dim);
+    weights((size_t)config.seq_len * head_size, 1.0f); // unused freq_cis_real and freq_cis_imag
+
+    fclose(file);
+}
+
+// LoRA adapter of the given rank over every projection of every layer
+static void write_adapter(const std::string& path, Config config, int rank, unsigned long long seed) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) { fprintf(stderr, "Couldn't create %s\n", path.c_str()); exit(EXIT_FAILURE); }
+
+    const int targets = (int)lora_target::count;
+    LoraHeader header{LORA_MAGIC, LORA_VERSION, rank, 2.0f * rank, config.n_layers * targets};
+    fwrite(&header, sizeof(LoraHeader), 1, file);
+
+    synthetic_rng rng{seed};
+    int kv_dim = config.n_kv_heads * (config.dim / config.n_heads);
+    for (int l = 0 ; l < config.n_layers ; l++) {
+        for (int t = 0 ; t < targets ; t++) {
+            lora_target target = (lora_target)t;
+            int in = target == lora_target::weight2 ? config.hidden_dim : config.dim;
+            int out = config.dim;
+            if (target == lora_target::key || target == lora_target::value) { out = kv_dim; }
+            if (target == lora_target::weight1 || target == lora_target::weight3) { out = config.hidden_dim; }
+
+            LoraPairHeader pair{l, t};
+            fwrite(&pair, sizeof(LoraPairHeader), 1, file);
+            std::vector<float> a((size_t)rank * in), b((size_t)out * rank);
+            fill_random(a, rng, 1.0f / in);
+            fill_random(b, rng, 1.0f / rank);
+            write_values(file, a, dtype::f32);
+            write_values(file, b, dtype::f32);
+        }
+    }
+
+    fclose(file);
+}
+
+// tokenizer with <unk>, <s>, </s>, the 256 byte tokens, and then merges of
+// printable ascii until vocab_size is reached
+static void write_tokenizer(const std::string& path, int vocab_size) {
+    std::vector<std::string> vocab = {"<unk>", "<s>", "</s>"};
+    char buf[8];
+    for (int i = 0 ; i < 256 ; i++) {
+        snprintf(buf, sizeof(buf), "<0x%02X>", i);
+        vocab.push_back(buf);
+    }
+
+    const std::string alphabet = " etaoinshrdlcumwfgypbvkjxqz";
+    for (char c : alphabet) {
+        vocab.push_back(std::string(1, c));
+    }
+
+    for (size_t i = 0 ; i < alphabet.size() && (int)vocab.size() < vocab_size ; i++) {
+        for (size_t j = 0 ; j < alphabet.size() && (int)vocab.size() < vocab_size ; j++) {
+            vocab.push_back(std::string(1, alphabet[i]) + alphabet[j]);
+        }
+    }
+
+    for (size_t i = 0 ; (int)vocab.size() < vocab_size ; i++) {
+        // three letter merges of the earlier pairs
+        vocab.push_back(vocab[259 + alphabet.size() + i] + alphabet[i % alphabet.size()]);
+    }
+
+    vocab.resize(vocab_size);
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) { fprintf(stderr, "Couldn't create %s\n", path.c_str()); exit(EXIT_FAILURE); }
+
+    int max_token_length = 0;
+    for (const std::string& piece : vocab) {
+        max_token_length = std::max(max_token_length, (int)piece.size());
+    }
+
+    fwrite(&max_token_length, sizeof(int), 1, file);
+    for (int i = 0 ; i < vocab_size ; i++) {
+        // longer merges score higher, like a trained vocabulary would
+        float score = i < 259 ? 0.0f : (float)vocab[i].size() - i * 1e-6f;
+        int len = vocab[i].size();
+        fwrite(&score, sizeof(float), 1, file);
+        fwrite(&len, sizeof(int), 1, file);
+        fwrite(vocab[i].data(), 1, len, file);
+    }
+
+    fclose(file);
+}
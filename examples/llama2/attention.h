@@ -1,10 +1,31 @@
+#ifndef __llama2_attention_h
+#define __llama2_attention_h
+
 #include "config.h"
 #include "tensor.h"
+#include "graph.h"
+#include "memory.h"
+#include "communicator.h"
+#include "lora.h"
+#include <cassert>
+#include <cstring>
+#include <initializer_list>
 #include <iostream>
 
 class attention {
     //config
     Config config;
+    int layer; // index of this layer in the model, for tracing
+    int head_size;
+    // of this rank's shard, the whole layer unless sharded
+    int n_heads;
+    int n_kv_heads;
+    int q_dim;
+    int kv_dim;
+    int hidden_dim;
+    shm_communicator* comm = nullptr; // sums the shards' partial outputs
+    int sinks = -1; // >= 0: the kv cache is a sliding window keeping this many first tokens
+    const lora_bank* adapters = nullptr; // low-rank deltas over the projections, per row
 
     //weights
     tensor rms_att_weight;
@@ -20,157 +41,328 @@ class attention {
 
     tensor rms_ffn_weight;
 
+    // query|key|value and weight1|weight3 stacked, to run one matmul for each group
+    tensor wqkv;
+    tensor w13;
+
+    // weight2 transposed, for a down projection over only the largest hidden activations
+    tensor weight2_t;
+    float sparse_threshold = 0.0f;
+    int sparse_top_k = 0;
+
     //kv_cache
     tensor key_cache;
     tensor value_cache;
+    tensor sink_keys; // with a sliding window, the sinks' keys as they were stored
 
     public:
         attention() {}
-        attention (Config config) : config{config} {
-            int head_size = config.dim / config.n_heads;
-            key_cache = tensor{{config.seq_len, config.n_kv_heads * head_size}};
-            value_cache = tensor{{config.seq_len, config.n_kv_heads * head_size}};
+        attention (Config config, int layer = 0) : config{config}, layer{layer} {
+            head_size = config.dim / config.n_heads;
+            n_heads = config.n_heads;
+            n_kv_heads = config.n_kv_heads;
+            q_dim = config.dim;
+            kv_dim = (config.dim * config.n_kv_heads) / config.n_heads;
+            hidden_dim = config.hidden_dim;
+
+            memory::scope kv{memory::category::kv_cache};
+            key_cache = tensor{{config.seq_len, kv_dim}};
+            value_cache = tensor{{config.seq_len, kv_dim}};
         }
 
-        ssize_t set_rms_att_weight(float* w) {
-            rms_att_weight = tensor{w, {1, config.dim}};
+        ssize_t set_rms_att_weight(void* w, dtype type = dtype::f32) {
+            // norm weights are tiny and used elementwise, always keep them in fp32
+            memory::scope weights{memory::category::weights};
+            rms_att_weight = tensor{w, {1, config.dim}, type}.to(dtype::f32);
             return rms_att_weight.size();
         }
 
-        ssize_t set_query(float* q) {
-            int head_size = config.dim / config.n_heads;
-            query = tensor(q, {config.dim, config.n_heads * head_size});
+        ssize_t set_query(void* q, dtype type = dtype::f32) {
+            query = tensor(q, {config.dim, config.n_heads * head_size}, type);
             return query.size();
         }
 
-        ssize_t set_key(float* k) {
-            int head_size = config.dim / config.n_heads;
-
-            key = tensor(k, {config.dim, config.n_kv_heads * head_size});
+        ssize_t set_key(void* k, dtype type = dtype::f32) {
+            key = tensor(k, {kv_dim, config.dim}, type);
             return key.size();
         }
 
-        ssize_t set_value(float* v) {
-            int head_size = config.dim / config.n_heads;
-
-            value = tensor(v, {config.dim, config.n_kv_heads * head_size});
+        ssize_t set_value(void* v, dtype type = dtype::f32) {
+            value = tensor(v, {kv_dim, config.dim}, type);
             return value.size();
         }
 
-        ssize_t set_weight_o(float* w) {
-            int head_size = config.dim / config.n_heads;
-
-            weight_o = tensor(w, {config.n_heads * head_size, config.dim});
+        ssize_t set_weight_o(void* w, dtype type = dtype::f32) {
+            weight_o = tensor(w, {config.n_heads * head_size, config.dim}, type);
             return weight_o.size();
         }
 
-        ssize_t set_ffn_weights1(float* w1) {
-            weight1 = tensor{w1, {config.hidden_dim, config.dim}};
+        ssize_t set_ffn_weights1(void* w1, dtype type = dtype::f32) {
+            weight1 = tensor{w1, {config.hidden_dim, config.dim}, type};
             return weight1.size();
         }
 
-        ssize_t set_ffn_weights2(float* w2) {
-            weight2 = tensor{w2, {config.dim, config.hidden_dim}};
+        ssize_t set_ffn_weights2(void* w2, dtype type = dtype::f32) {
+            weight2 = tensor{w2, {config.dim, config.hidden_dim}, type};
             return weight2.size();
         }
 
-        ssize_t set_ffn_weights3(float* w3) {
-            weight3 = tensor{w3, {config.hidden_dim, config.dim}};
+        ssize_t set_ffn_weights3(void* w3, dtype type = dtype::f32) {
+            weight3 = tensor{w3, {config.hidden_dim, config.dim}, type};
             return weight3.size();
         }
 
-        ssize_t set_rms_ffn_weight(float* w) {
-            rms_ffn_weight = tensor{w, {1, config.dim}};
+        ssize_t set_rms_ffn_weight(void* w, dtype type = dtype::f32) {
+            // norm weights are tiny and used elementwise, always keep them in fp32
+            memory::scope weights{memory::category::weights};
+            rms_ffn_weight = tensor{w, {1, config.dim}, type}.to(dtype::f32);
             return rms_ffn_weight.size();
         }
 
-        tensor forward(tensor x, int pos) {
-            int kv_dim = (config.dim * config.n_kv_heads) / config.n_heads;
-            int head_size = config.dim / config.n_heads;
-            int kv_mul = config.n_heads / config.n_kv_heads;
+        // Stack the projections that read the same input: the layer then runs one matmul
+        // for q, k and v and one for the gate and up projections, with the SwiGLU in
+        // its epilogue. The stacks are copies of the weights, set all of them first and
+        // build the graph again afterwards.
+        void fuse_projections() {
+            memory::scope weights{memory::category::weights};
+            wqkv = stack({&query, &key, &value});
+            w13 = stack({&weight1, &weight3});
+        }
 
-            tensor xb = rms_norm(x, rms_att_weight);
+        // back to the separate matrices, which only reference the checkpoint
+        void unfuse_projections() {
+            wqkv = tensor();
+            w13 = tensor();
+        }
 
-            tensor q = xb * query;
-            tensor k = xb * key;
-            tensor v = xb * value;
-            
-            // RoPE relative positional encoding: complex-valued rotate q and k in each head
-            for (int i = 0 ; i < config.dim ; i += 2) {
-                int head_dim = i % head_size;
-                float freq = 1.0f / powf(10000.0f, head_dim / (float)head_size);
-                float val = pos * freq;
-                float fcr = cosf(val);
-                float fci = sinf(val);
-                int rotn = i < kv_dim ? 2 : 1; // how many vectors? 2 = q & k, 1 = q only
-
-                for (int v = 0 ; v < rotn ; v++) {
-                    if (v == 0) {
-                        float v0 = q[{0, i}];
-                        float v1 = q[{0, i+1}];
-
-                        q[{0, i}] = v0 * fcr - v1 * fci;
-                        q[{0, i+1}] = v0 * fci + v1 * fcr;
-                    } else {
-                        float v0 = k[{0, i}];
-                        float v1 = k[{0, i+1}];
-
-                        k[{0, i}] = v0 * fcr - v1 * fci;
-                        k[{0, i+1}] = v0 * fci + v1 * fcr;
-                    }
-                }
+        bool fused() const { return wqkv.size() > 0; }
+
+        // Keep only the part of the layer rank computes out of n_ranks: its key/value
+        // heads with the query heads sharing them, and its slice of the FFN hidden units.
+        // Those are rows of query, key, value, weight1 and weight3, still views of the
+        // checkpoint, so pages of the other ranks' rows are never touched. weight_o and
+        // weight2 are split by columns instead, which are copied out once. Each rank's
+        // attention and FFN outputs are partial sums, added up over comm. Call before
+        // fusing, n_kv_heads and hidden_dim must divide evenly.
+        void shard(int rank, int n_ranks, shm_communicator& comm) {
+            assert(config.n_kv_heads % n_ranks == 0 && config.hidden_dim % n_ranks == 0);
+            if (n_ranks == 1) { return; } // the whole layer, and same size views would write through
+            n_kv_heads = config.n_kv_heads / n_ranks;
+            n_heads = n_kv_heads * (config.n_heads / config.n_kv_heads);
+            q_dim = n_heads * head_size;
+            kv_dim = n_kv_heads * head_size;
+            hidden_dim = config.hidden_dim / n_ranks;
+
+            query = rows(query, rank * q_dim, q_dim);
+            key = rows(key, rank * kv_dim, kv_dim);
+            value = rows(value, rank * kv_dim, kv_dim);
+            weight1 = rows(weight1, rank * hidden_dim, hidden_dim);
+            weight3 = rows(weight3, rank * hidden_dim, hidden_dim);
+            {
+                memory::scope weights{memory::category::weights};
+                weight_o = columns(weight_o, rank * q_dim, q_dim);
+                weight2 = columns(weight2, rank * hidden_dim, hidden_dim);
             }
 
-            for (int i = 0 ; i < k.size() ; i++) {
-                key_cache[{pos, i}] = k[{0,i}];
-                value_cache[{pos, i}] = v[{0,i}];
+            memory::scope kv{memory::category::kv_cache};
+            key_cache = tensor{{config.seq_len, kv_dim}};
+            value_cache = tensor{{config.seq_len, kv_dim}};
+            this->comm = &comm;
+        }
+
+        // Down projection over the hidden activations with |h| > threshold only, or the
+        // top_k largest if top_k > 0: the weight2 columns of the others are never read.
+        // Keeps a transposed copy of weight2, whose columns become contiguous rows. A
+        // negative threshold with no top_k goes back to the dense matmul. Set it after
+        // sharding, and build the graph again.
+        void set_sparse_ffn(float threshold, int top_k = 0) {
+            sparse_threshold = threshold;
+            sparse_top_k = top_k;
+            if (threshold < 0.0f && top_k <= 0) {
+                weight2_t = tensor();
+                return;
             }
 
-            q.set_shape({config.n_heads, head_size});
-            k.set_shape({config.n_kv_heads, head_size});
-            v.set_shape({config.n_kv_heads, head_size});
-            
-            tensor att{{1, pos+1}};
-            xb = tensor{{1, head_size * config.n_heads}, 0.0f};
-            for (int h = 0 ; h < config.n_heads ; h++) {
-                int idx = h * head_size;
-                for (int t = 0 ; t <= pos ; t++) {
-                    float score = 0.0f;
-                    for (int i = 0 ; i < head_size ; i++) {
-                        score += q[{h, i}] * key_cache[{t, (idx / kv_mul) + i}];
-                    }
+            memory::scope weights{memory::category::weights};
+            weight2_t = transposed(weight2);
+        }
 
-                    score /= sqrtf(head_size);
-                    // save the score to the attention buffer
-                    att[{0, t}] = score;
-                }
+        bool sparse_ffn() const { return weight2_t.size() > 0; }
 
-                att = softmax(att);
-           
-                for (int t = 0 ; t <= pos ; t++) {
-                    float a = att[{0, t}];
+        // Apply the adapters of bank to the projections, each row of a run with its own
+        // (see graph::lora); nullptr for none. The fused gate and up projections then run
+        // as a plain matmul, the delta has to go in before the SwiGLU. Build the graph again.
+        void set_adapters(const lora_bank* bank) { adapters = bank; }
 
-                    for (int i = 0 ; i < head_size ; i++) {
-                        xb[{0, idx + i}] += a * value_cache[{t, (idx / kv_mul) + i}];
+        // slot of the pair adapting target in this layer
+        static int lora_slot(int layer, lora_target target) {
+            return layer * (int)lora_target::count + (int)target;
+        }
+
+        std::pair<int, int> cache_shape() const { return {config.seq_len, kv_dim}; }
+        const tensor& keys() const { return key_cache; }
+        const tensor& values() const { return value_cache; }
+
+        // keep the kv cache in memory owned by someone else from now on, e.g. a mapped
+        // session, of cache_shape() each. The graph keeps working on it as it is.
+        void set_cache(float* keys, float* values) {
+            key_cache.set_data(keys, key_cache.size());
+            value_cache.set_data(values, value_cache.size());
+        }
+
+        // keep the first sinks tokens and a window of the most recent ones in the kv cache,
+        // so generation goes on past seq_len; -1 for the plain cache. Build the graph again.
+        void set_sliding_window(int sinks) { this->sinks = sinks; }
+        bool sliding_window() const { return sinks >= 0; }
+        // of the sinks' keys kept next to a sliding window cache, no rows without one
+        std::pair<int, int> sink_shape() const { return {std::max(sinks, 0), kv_dim}; }
+
+        // append the ops of this layer to g, x is the residual stream
+        graph::value build(graph& g, graph::value x) {
+            // the sink keys stay with the cache, graphs built again carry on with them
+            if (sinks > 0 && sink_keys.shape() != sink_shape()) {
+                memory::scope kv{memory::category::kv_cache};
+                sink_keys = tensor{sink_shape()};
+            }
+
+            return build(g, x, key_cache, value_cache, sinks > 0 ? &sink_keys : nullptr);
+        }
+
+        // the same with the kv cache of another sequence, of cache_shape(), and with a
+        // sliding window its sink keys, of sink_shape()
+        graph::value build(graph& g, graph::value x, tensor& key_cache, tensor& value_cache, tensor* sink_keys = nullptr) {
+            return build(g, x, &key_cache, &value_cache, sink_keys, nullptr);
+        }
+
+        // the same with this layer of a paged cache shared by the sequences of a batch,
+        // whose rows are kv_width() wide
+        graph::value build(graph& g, graph::value x, paged_kv_cache& pages) {
+            return build(g, x, nullptr, nullptr, nullptr, &pages);
+        }
+
+        int kv_width() const { return kv_dim; }
+
+    private:
+        graph::value build(graph& g, graph::value x, tensor* key_cache, tensor* value_cache, tensor* sink_keys,
+                           paged_kv_cache* pages) {
+            g.set_layer(layer);
+            graph::value xb = g.rms_norm(x, rms_att_weight);
+
+            // y plus the delta of the row's adapter for target, at offset of y
+            auto adapt = [&](graph::value y, graph::value x, lora_target target, int offset = 0) {
+                return adapters ? g.lora(y, x, *adapters, lora_slot(layer, target), offset, "lora") : y;
+            };
+
+            graph::value q, k, v;
+            if (fused()) {
+                graph::value qkv = g.linear(xb, wqkv, "matmul_qkv");
+                qkv = adapt(qkv, xb, lora_target::query);
+                qkv = adapt(qkv, xb, lora_target::key, q_dim);
+                qkv = adapt(qkv, xb, lora_target::value, q_dim + kv_dim);
+                q = g.slice(qkv, 0, q_dim);
+                k = g.slice(qkv, q_dim, kv_dim);
+                v = g.slice(qkv, q_dim + kv_dim, kv_dim);
+            } else {
+                q = adapt(g.linear(xb, query, "matmul_wq"), xb, lora_target::query);
+                k = adapt(g.linear(xb, key, "matmul_wk"), xb, lora_target::key);
+                v = adapt(g.linear(xb, value, "matmul_wv"), xb, lora_target::value);
+            }
+
+            // RoPE relative positional encoding: complex-valued rotate q and k in each head
+            q = g.rope(q, head_size);
+            k = g.rope(k, head_size);
+
+            // multihead attention, query heads share a key/value head in groups of n_heads / n_kv_heads
+            xb = pages ? g.attention(q, k, v, *pages, layer, n_heads, n_kv_heads)
+                       : g.attention(q, k, v, *key_cache, *value_cache, n_heads, n_kv_heads, sinks, sink_keys);
+            graph::value o = adapt(g.linear(xb, weight_o, "matmul_wo"), xb, lora_target::weight_o);
+            if (comm) { o = g.all_reduce(o, *comm); }
+            x = g.add(x, o);
+
+            xb = g.rms_norm(x, rms_ffn_weight);
+            graph::value hb;
+            if (fused() && !adapters) {
+                hb = g.swiglu(xb, w13, "matmul_w13");
+            } else if (fused()) {
+                graph::value h13 = g.linear(xb, w13, "matmul_w13");
+                h13 = adapt(h13, xb, lora_target::weight1);
+                h13 = adapt(h13, xb, lora_target::weight3, hidden_dim);
+                hb = g.mul(g.silu(g.slice(h13, 0, hidden_dim)), g.slice(h13, hidden_dim, hidden_dim));
+            } else {
+                graph::value gate = adapt(g.linear(xb, weight1, "matmul_w1"), xb, lora_target::weight1);
+                graph::value up = adapt(g.linear(xb, weight3, "matmul_w3"), xb, lora_target::weight3);
+                hb = g.mul(g.silu(gate), up);
+            }
+
+            graph::value down = sparse_ffn() ? g.sparse_linear(hb, weight2_t, sparse_threshold, sparse_top_k, "matmul_w2_sparse")
+                                             : g.linear(hb, weight2, "matmul_w2");
+            down = adapt(down, hb, lora_target::weight2);
+            if (comm) { down = g.all_reduce(down, *comm); }
+            return g.add(x, down);
+        }
+
+        static char* storage(const tensor& t) {
+            return t.type() == dtype::f32 ? (char*)t.get_data() : (char*)t.get_half_data();
+        }
+
+        // view of rows [first, first + count)
+        static tensor rows(const tensor& t, int first, int count) {
+            size_t row_bytes = t.columns() * dtype_size(t.type());
+            return tensor{storage(t) + first * row_bytes, {count, (int)t.columns()}, t.type()};
+        }
+
+        // copy of columns [first, first + count)
+        static tensor columns(const tensor& t, int first, int count) {
+            size_t elem_size = dtype_size(t.type());
+            tensor res{{(int)t.rows(), count}, t.type()};
+            for (size_t r = 0 ; r < t.rows() ; r++) {
+                memcpy(storage(res) + r * count * elem_size, storage(t) + (r * t.columns() + first) * elem_size,
+                       count * elem_size);
+            }
+
+            return res;
+        }
+
+        static tensor transposed(const tensor& t) {
+            const size_t rows = t.rows();
+            const size_t cols = t.columns();
+            tensor res{{(int)cols, (int)rows}, t.type()};
+            if (t.type() == dtype::f32) {
+                for (size_t r = 0 ; r < rows ; r++) {
+                    for (size_t c = 0 ; c < cols ; c++) {
+                        res.get_data()[c * rows + r] = t.get_data()[r * cols + c];
+                    }
+                }
+            } else {
+                for (size_t r = 0 ; r < rows ; r++) {
+                    for (size_t c = 0 ; c < cols ; c++) {
+                        res.get_half_data()[c * rows + r] = t.get_half_data()[r * cols + c];
                     }
                 }
             }
-            
-            //some calculation went wrong above here
-            tensor xb2 = xb * weight_o;
-            x = x + xb2;
-            xb = rms_norm(x, rms_ffn_weight);
 
-            tensor hb = xb * weight1;
-            tensor hb2 = xb * weight3;
-            
-            hb = silu(hb) * hb2;
-            xb = hb * weight2;
-            x = x + xb;
-            return x;
+            return res;
         }
 
-        tensor operator() (tensor& x, int pos) {
-            return forward(x, pos);
+        // the matrices one under the other, in their storage type
+        static tensor stack(std::initializer_list<const tensor*> parts) {
+            const tensor& first = **parts.begin();
+            int rows = 0;
+            for (const tensor* part : parts) {
+                assert(part->columns() == first.columns() && part->type() == first.type());
+                rows += part->rows();
+            }
+
+            tensor res{{rows, (int)first.columns()}, first.type()};
+            char* dst = res.type() == dtype::f32 ? (char*)res.get_data() : (char*)res.get_half_data();
+            for (const tensor* part : parts) {
+                const char* src = part->type() == dtype::f32 ? (const char*)part->get_data() : (const char*)part->get_half_data();
+                memcpy(dst, src, part->bytes());
+                dst += part->bytes();
+            }
+
+            return res;
         }
 };
+
+#endif
@@ -1,3 +1,6 @@
+#ifndef __llama2_config_h
+#define __llama2_config_h
+
 struct Config {
     int dim; // transformer dimension
     int hidden_dim; // for ffn layers
@@ -6,4 +9,58 @@ struct Config {
     int n_kv_heads; // number of key/value heads (can be < query heads because of multiquery)
     int vocab_size; // vocabulary size, usually 256 (byte-level)
     int seq_len; // max sequence length
-};
\ No newline at end of file
+};
+
+// Checkpoints storing the weights in half precision start with this header, followed
+// by the Config and the weights in the same order as the legacy fp32 llama2.c format.
+// Legacy checkpoints have no header and start directly with the Config.
+struct CheckpointHeader {
+    int magic; // CHECKPOINT_MAGIC
+    int version; // CHECKPOINT_VERSION
+    int dtype; // storage type of every weight, see dtype in half.h
+};
+
+const int CHECKPOINT_MAGIC = 0x666e6974; // "tinf" in little endian
+const int CHECKPOINT_VERSION = 1;
+
+// LoRA adapter files start with this header, followed by n_pairs pairs: a
+// LoraPairHeader, then A [rank x in] and B [out x rank] in fp32, in and out being
+// those of the projection adapted.
+struct LoraHeader {
+    int magic; // LORA_MAGIC
+    int version; // LORA_VERSION
+    int rank;
+    float alpha; // the delta is scaled by alpha / rank
+    int n_pairs;
+};
+
+// the projections an adapter may cover, in the order of their weights in the checkpoint
+enum class lora_target : int { query, key, value, weight_o, weight1, weight2, weight3, count };
+
+struct LoraPairHeader {
+    int layer;
+    int target; // lora_target
+};
+
+const int LORA_MAGIC = 0x61726f6c; // "lora" in little endian
+const int LORA_VERSION = 1;
+
+// Session snapshots (llama2::save_session) start with this header, on a page of its
+// own. The kv cache of every layer follows, keys then values: n_tokens rows of kv_dim
+// floats, each padded to a page so that they can be mapped straight back in place.
+struct SessionHeader {
+    int magic; // SESSION_MAGIC
+    int version; // SESSION_VERSION
+    Config config;
+    int kv_dim; // of every layer
+    int page_size; // the padding
+    int n_tokens; // positions in the cache, the next one to run
+    int token; // to run at position n_tokens
+    unsigned long long rng_state; // of the sampler
+    long long checkpoint_bytes; // size of the checkpoint, to catch another model
+};
+
+const int SESSION_MAGIC = 0x73736573; // "sess" in little endian
+const int SESSION_VERSION = 1;
+
+#endif
@@ -0,0 +1,390 @@
+#ifndef __llama2_constraint_h
+#define __llama2_constraint_h
+
+#include "encoder/bpe.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// ----------------------------------------------------------------------------
+// Constrained decoding: only tokens that keep the output in a grammar may be
+// sampled. The text of every token goes into a trie once; each step walks it
+// from the grammar state, dropping a whole subtree as soon as a character is
+// rejected, and sets the bits of the tokens whose text was accepted. Masks are
+// cached by grammar state, which repeats a lot (inside strings, between array
+// items), so most steps are a lookup. Sampler::sample(logits, mask) applies it.
+
+// A JSON value, character by character. The output so far is a state: the open
+// containers and where we are in the innermost one. Within a token the grammar
+// steps a cursor, a fixed-size copy of the position that records the containers
+// opened and closed since the state, so the trie walk copies it without touching
+// the heap. Cursors follow up to 64 containers opened within one token.
+class json_grammar {
+    enum mode : uint8_t {
+        value,        // a value is expected
+        first_item,   // right after [: a value or ]
+        first_key,    // right after {: a key or }
+        next_key,     // after a comma in an object
+        colon,
+        after_value,  // a comma or the end of the container, or the end
+        string,
+        escape,
+        unicode,      // sub hex digits still to come
+        number,       // sub is where in the number we are
+        literal,      // the rest of true/false/null, sub indexes literals
+        done
+    };
+
+    // number: after '-', after '0', in the integer, after '.', in the fraction,
+    // after 'e', after its sign, in the exponent
+    enum number_part : uint8_t { sign, zero, integer, point, fraction, exp_mark, exp_sign, exponent };
+
+    static const char* literals() { return "true\0false\0null\0"; }
+
+public:
+    struct state {
+        std::string stack;   // open containers, '{' or '['
+        uint8_t mode = value;
+        uint8_t sub = 0;
+        bool in_key = false; // the string is an object key
+    };
+
+    struct cursor {
+        uint8_t mode;
+        uint8_t sub;
+        bool in_key;
+        uint8_t pushed = 0;  // containers opened since the state, bit i of opens set for '['
+        uint64_t opens = 0;
+        size_t popped = 0;   // containers of the state's stack closed
+    };
+
+    state start() const { return state{}; }
+
+    cursor begin(const state& s) const {
+        cursor c;
+        c.mode = s.mode;
+        c.sub = s.sub;
+        c.in_key = s.in_key;
+        return c;
+    }
+
+    // s as it is after the cursor c stepped from it
+    void commit(state& s, const cursor& c) const {
+        s.stack.resize(s.stack.size() - c.popped);
+        for (int i = 0 ; i < c.pushed ; i++) {
+            s.stack += (c.opens >> i & 1) ? '[' : '{';
+        }
+
+        s.mode = c.mode;
+        s.sub = c.sub;
+        s.in_key = c.in_key;
+    }
+
+    // a whole value was read, only whitespace may follow
+    bool accepting(const state& s) const {
+        return s.mode == done || (s.mode == number && s.stack.empty() && complete_number(s.sub));
+    }
+
+    // equal for states that allow the same continuations of at most length bytes:
+    // those cannot close more than the length innermost containers
+    std::string key(const state& s, size_t length) const {
+        bool sub = s.mode == number || s.mode == literal || s.mode == unicode;
+        std::string key = s.stack.size() > length ? s.stack.substr(s.stack.size() - length) : s.stack;
+        key += (char)(s.stack.size() > length);
+        return key + (char)s.mode + (char)(sub ? s.sub : 0) + (char)s.in_key;
+    }
+
+    // advance c, from the state base, by ch; false if ch cannot come next (c is then undefined)
+    bool step(const state& base, cursor& c, unsigned char ch) const {
+        bool space = ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+        switch (c.mode) {
+            case value:
+            case first_item:
+                if (space) { return true; }
+                if (c.mode == first_item && ch == ']') { return close(base, c, '['); }
+                return begin_value(c, ch);
+            case first_key:
+            case next_key:
+                if (space) { return true; }
+                if (c.mode == first_key && ch == '}') { return close(base, c, '{'); }
+                if (ch != '"') { return false; }
+                c.mode = string;
+                c.in_key = true;
+                return true;
+            case colon:
+                if (space) { return true; }
+                if (ch != ':') { return false; }
+                c.mode = value;
+                return true;
+            case after_value:
+                if (space) { return true; }
+                if (ch == ',' && top(base, c) != 0) {
+                    c.mode = top(base, c) == '{' ? next_key : value;
+                    return true;
+                }
+                return (ch == '}' && close(base, c, '{')) || (ch == ']' && close(base, c, '['));
+            case string:
+                if (ch == '"') {
+                    c.mode = c.in_key ? (uint8_t)colon : end_value(base, c);
+                    c.in_key = false;
+                    return true;
+                }
+                if (ch == '\\') { c.mode = escape; }
+                return ch >= 0x20;
+            case escape:
+                if (ch == 'u') {
+                    c.mode = unicode;
+                    c.sub = 4;
+                    return true;
+                }
+                c.mode = string;
+                return strchr("\"\\/bfnrt", ch) != nullptr && ch != 0;
+            case unicode:
+                if (!isxdigit(ch)) { return false; }
+                if (--c.sub == 0) { c.mode = string; }
+                return true;
+            case number:
+                if (step_number(c, ch)) { return true; }
+                // the number ends with the first character that cannot continue it
+                if (!complete_number(c.sub)) { return false; }
+                c.mode = end_value(base, c);
+                return step(base, c, ch);
+            case literal: {
+                const char* rest = literals() + c.sub;
+                if (ch != (unsigned char)*rest) { return false; }
+                c.sub++;
+                if (rest[1] == '\0') { c.mode = end_value(base, c); }
+                return true;
+            }
+            case done:
+                return space;
+        }
+
+        return false;
+    }
+
+private:
+    // the innermost open container, 0 at the top level
+    static char top(const state& base, const cursor& c) {
+        if (c.pushed > 0) { return (c.opens >> (c.pushed - 1) & 1) ? '[' : '{'; }
+        if (c.popped < base.stack.size()) { return base.stack[base.stack.size() - 1 - c.popped]; }
+        return 0;
+    }
+
+    static uint8_t end_value(const state& base, const cursor& c) {
+        return top(base, c) == 0 ? done : after_value;
+    }
+
+    static bool open(cursor& c, char container) {
+        if (c.pushed == 64) { return false; }
+        if (container == '[') { c.opens |= 1ull << c.pushed; }
+        else { c.opens &= ~(1ull << c.pushed); }
+        c.pushed++;
+        return true;
+    }
+
+    static bool close(const state& base, cursor& c, char container) {
+        if (top(base, c) != container) { return false; }
+        if (c.pushed > 0) { c.pushed--; }
+        else { c.popped++; }
+        c.mode = end_value(base, c);
+        return true;
+    }
+
+    static bool begin_value(cursor& c, unsigned char ch) {
+        switch (ch) {
+            case '{': c.mode = first_key; return open(c, '{');
+            case '[': c.mode = first_item; return open(c, '[');
+            case '"': c.mode = string; c.in_key = false; return true;
+            case '-': c.mode = number; c.sub = sign; return true;
+            case '0': c.mode = number; c.sub = zero; return true;
+            case 't': c.mode = literal; c.sub = 1; return true;  // "true"
+            case 'f': c.mode = literal; c.sub = 6; return true;  // "false"
+            case 'n': c.mode = literal; c.sub = 12; return true; // "null"
+        }
+
+        if (ch >= '1' && ch <= '9') {
+            c.mode = number;
+            c.sub = integer;
+            return true;
+        }
+
+        return false;
+    }
+
+    static bool complete_number(uint8_t part) {
+        return part == zero || part == integer || part == fraction || part == exponent;
+    }
+
+    static bool step_number(cursor& c, unsigned char ch) {
+        bool digit = ch >= '0' && ch <= '9';
+        switch (c.sub) {
+            case sign:
+                if (ch == '0') { c.sub = zero; return true; }
+                if (digit) { c.sub = integer; return true; }
+                return false;
+            case zero:
+            case integer:
+                if (digit && c.sub == integer) { return true; }
+                if (ch == '.') { c.sub = point; return true; }
+                if (ch == 'e' || ch == 'E') { c.sub = exp_mark; return true; }
+                return false;
+            case point:
+            case fraction:
+                if (digit) { c.sub = fraction; return true; }
+                if (c.sub == fraction && (ch == 'e' || ch == 'E')) { c.sub = exp_mark; return true; }
+                return false;
+            case exp_mark:
+                if (ch == '+' || ch == '-') { c.sub = exp_sign; return true; }
+                if (digit) { c.sub = exponent; return true; }
+                return false;
+            case exp_sign:
+            case exponent:
+                if (digit) { c.sub = exponent; return true; }
+                return false;
+        }
+
+        return false;
+    }
+};
+
+// the texts of a vocabulary as a trie of bytes, children of a node contiguous
+class vocab_trie {
+public:
+    struct node {
+        unsigned char c;
+        int first_child = 0;
+        int n_children = 0;
+        int first_token = 0; // in tokens, of the texts ending here
+        int n_tokens = 0;
+    };
+
+    std::vector<node> nodes; // nodes[0] is the root
+    std::vector<int> tokens;
+    size_t max_length = 0;   // of the texts
+
+    vocab_trie(const bpe& tokenizer, int vocab_size) {
+        // build with sorted texts: the children of every node come out in one run
+        // <unk>, <s> and </s> (0 to 2) are control tokens, not text: the constraint
+        // allows BOS and EOS on its own, once the output is complete
+        std::vector<std::pair<std::string, int>> texts;
+        for (int t = 3 ; t < vocab_size ; t++) {
+            std::string text = tokenizer.text(t);
+            if (!text.empty()) { texts.push_back({text, t}); }
+            max_length = std::max(max_length, text.size());
+        }
+
+        std::sort(texts.begin(), texts.end());
+        nodes.push_back(node{});
+        build(0, texts, 0, texts.size(), 0);
+    }
+
+private:
+    // the subtree of node for texts [begin, end), which share their first depth bytes
+    void build(int n, const std::vector<std::pair<std::string, int>>& texts, size_t begin, size_t end, size_t depth) {
+        nodes[n].first_token = tokens.size();
+        while (begin < end && texts[begin].first.size() == depth) {
+            tokens.push_back(texts[begin++].second);
+        }
+
+        nodes[n].n_tokens = tokens.size() - nodes[n].first_token;
+        std::vector<std::pair<size_t, size_t>> runs;
+        for (size_t i = begin ; i < end ; ) {
+            size_t j = i;
+            while (j < end && texts[j].first[depth] == texts[i].first[depth]) { j++; }
+            runs.push_back({i, j});
+            i = j;
+        }
+
+        nodes[n].first_child = nodes.size();
+        nodes[n].n_children = runs.size();
+        for (const auto& run : runs) {
+            node child;
+            child.c = texts[run.first].first[depth];
+            nodes.push_back(child);
+        }
+
+        for (size_t r = 0 ; r < runs.size() ; r++) {
+            build(nodes[n].first_child + r, texts, runs[r].first, runs[r].second, depth + 1);
+        }
+    }
+};
+
+// The tokens allowed after the output so far by a Grammar (see json_grammar for
+// what it provides). BOS (1) and EOS (2), which end the generation, are allowed
+// once the grammar accepts. A cache miss walks the trie with cursors, which are
+// plain values; the cache holds at most max_masks masks.
+template <typename Grammar>
+class token_constraint {
+    typedef typename Grammar::state state;
+    typedef typename Grammar::cursor cursor;
+
+    Grammar grammar;
+    vocab_trie trie;
+    const bpe& tokenizer;
+    int vocab_size;
+    state current;
+    std::unordered_map<std::string, std::vector<uint64_t>> masks; // by grammar key
+    static const size_t max_masks = 1024;
+
+    void walk(int n, const cursor& c, std::vector<uint64_t>& mask) const {
+        const vocab_trie::node& parent = trie.nodes[n];
+        for (int i = 0 ; i < parent.n_children ; i++) {
+            const int child = parent.first_child + i;
+            cursor next = c;
+            if (!grammar.step(current, next, trie.nodes[child].c)) { continue; }
+            for (int t = 0 ; t < trie.nodes[child].n_tokens ; t++) {
+                int token = trie.tokens[trie.nodes[child].first_token + t];
+                mask[token / 64] |= 1ull << (token % 64);
+            }
+
+            walk(child, next, mask);
+        }
+    }
+
+public:
+    token_constraint(const bpe& tokenizer, int vocab_size, Grammar grammar = Grammar())
+    : grammar{grammar}, trie{tokenizer, vocab_size}, tokenizer{tokenizer}, vocab_size{vocab_size},
+      current{grammar.start()} {}
+
+    void reset() { current = grammar.start(); }
+    bool complete() const { return grammar.accepting(current); }
+
+    // bit t of mask[t / 64] for every token t allowed next, valid until the next call
+    const uint64_t* allowed() {
+        std::string key = grammar.key(current, trie.max_length);
+        auto found = masks.find(key);
+        if (found != masks.end()) {
+            return found->second.data();
+        }
+
+        if (masks.size() >= max_masks) { masks.clear(); }
+        std::vector<uint64_t>& mask = masks[key];
+        mask.assign((vocab_size + 63) / 64, 0);
+        walk(0, grammar.begin(current), mask);
+        if (grammar.accepting(current)) {
+            for (int token : {1, 2}) {
+                if (token < vocab_size) { mask[token / 64] |= 1ull << (token % 64); }
+            }
+        }
+
+        return mask.data();
+    }
+
+    // the output goes on with token, which must have been allowed
+    void accept(int token) {
+        cursor c = grammar.begin(current);
+        for (unsigned char ch : tokenizer.text(token)) {
+            grammar.step(current, c, ch);
+        }
+
+        grammar.commit(current, c);
+    }
+};
+
+#endif
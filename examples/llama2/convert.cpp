@@ -0,0 +1,55 @@
+#include "config.h"
+#include "half.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// ----------------------------------------------------------------------------
+// Converts a legacy fp32 llama2.c checkpoint into one with f16 or bf16 weights,
+// which llama2::read_checkpoint maps directly.
+//
+//   convert model.bin model-f16.bin f16
+
+int main(int argc, char *argv[]) {
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s <fp32 checkpoint> <output> <f16|bf16>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    dtype type;
+    if (strcmp(argv[3], "f16") == 0) {
+        type = dtype::f16;
+    } else if (strcmp(argv[3], "bf16") == 0) {
+        type = dtype::bf16;
+    } else {
+        fprintf(stderr, "Unknown dtype %s, expected f16 or bf16\n", argv[3]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (!in) { fprintf(stderr, "Couldn't open file %s\n", argv[1]); return EXIT_FAILURE; }
+    FILE *out = fopen(argv[2], "wb");
+    if (!out) { fprintf(stderr, "Couldn't open file %s\n", argv[2]); return EXIT_FAILURE; }
+
+    Config config;
+    if (fread(&config, sizeof(Config), 1, in) != 1) { fprintf(stderr, "Couldn't read config\n"); return EXIT_FAILURE; }
+
+    CheckpointHeader header{CHECKPOINT_MAGIC, CHECKPOINT_VERSION, (int)type};
+    fwrite(&header, sizeof(CheckpointHeader), 1, out);
+    fwrite(&config, sizeof(Config), 1, out);
+
+    // every weight keeps its place, so the rest of the file can be converted blindly
+    std::vector<float> src(1 << 20);
+    std::vector<uint16_t> dst(src.size());
+    size_t n;
+    while ((n = fread(src.data(), sizeof(float), src.size(), in)) > 0) {
+        from_fp32(dst.data(), src.data(), n, type);
+        fwrite(dst.data(), sizeof(uint16_t), n, out);
+    }
+
+    fclose(in);
+    if (fclose(out) != 0) { fprintf(stderr, "Couldn't write %s\n", argv[2]); return EXIT_FAILURE; }
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include "llama2.h"
+#include "encoder/bpe.h"
+#include "paged_kv_cache.h"
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ----------------------------------------------------------------------------
+// Teacher-forced evaluation: the perplexity of a model on a text file, e.g. to
+// check a quantized checkpoint or a new kernel against the reference. The text
+// is tokenized once and cut into windows of seq_len tokens, each starting with
+// BOS. A window runs batch positions per forward pass, the matmuls reading the
+// weights once for all of them, and the windows are spread over threads.
+//
+//   eval model.bin text.txt [threads] [batch]
+
+// one thread's graph over the shared weights, with a kv cache for one window
+struct window_runner {
+    paged_kv_cache cache;
+    graph program;
+    int batch;
+
+    window_runner(llama2& model, int window, int batch)
+    : cache{model.config.n_layers, model.layer(0).kv_width(), 16, (window + 15) / 16}, batch{batch} {
+        graph::value x = program.embedding(model.embedding_table());
+        for (int l = 0 ; l < model.config.n_layers ; l++) {
+            x = model.layer(l).build(program, x, cache);
+        }
+
+        program.set_layer(-1);
+        program.output(program.linear(program.rms_norm(x, model.final_norm()), model.classifier(), "classifier"));
+        program.compile(batch);
+    }
+
+    // negative log likelihood of tokens[1..] given the ones before, summed
+    double run(const std::vector<int>& tokens) {
+        int seq = cache.create();
+        double nll = 0.0;
+        std::vector<int> chunk, positions, sequences;
+        for (int start = 0 ; start + 1 < (int)tokens.size() ; start += batch) {
+            int rows = std::min(batch, (int)tokens.size() - 1 - start);
+            chunk.assign(tokens.begin() + start, tokens.begin() + start + rows);
+            positions.resize(rows);
+            for (int r = 0 ; r < rows ; r++) { positions[r] = start + r; }
+            sequences.assign(rows, seq);
+
+            tensor logits = program.run(chunk, positions, sequences);
+            const int vocab_size = logits.columns();
+            for (int r = 0 ; r < rows ; r++) {
+                const float* row = logits.get_data() + (size_t)r * vocab_size;
+                float max_val = *std::max_element(row, row + vocab_size);
+                double sum = 0.0;
+                for (int i = 0 ; i < vocab_size ; i++) {
+                    sum += exp(row[i] - max_val);
+                }
+
+                nll += max_val + log(sum) - row[tokens[start + r + 1]];
+            }
+        }
+
+        cache.release(seq);
+        return nll;
+    }
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <checkpoint> <text file> [threads] [batch]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int n_threads = argc > 3 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+    int batch = argc > 4 ? atoi(argv[4]) : 64;
+    if (n_threads < 1) n_threads = 1;
+    if (batch < 1) batch = 64;
+
+    llama2 model;
+    model.read_checkpoint(argv[1]);
+    model.fuse_projections();
+    bpe tokenizer("tokenizer.bin", model.config.vocab_size);
+
+    std::ifstream file{argv[2]};
+    if (!file) { fprintf(stderr, "Couldn't open file %s\n", argv[2]); return EXIT_FAILURE; }
+    std::stringstream text;
+    text << file.rdbuf();
+    std::vector<int> tokens = tokenizer.encode(text.str(), 0, 0);
+    // with BOS in front, a window needs at least two tokens to predict anything
+    if (tokens.empty()) { fprintf(stderr, "%s has no tokens to evaluate\n", argv[2]); return EXIT_FAILURE; }
+
+    // windows of BOS and the next seq_len - 1 tokens of the text
+    const int window = model.config.seq_len;
+    std::vector<std::vector<int>> windows;
+    for (size_t start = 0 ; start < tokens.size() ; start += window - 1) {
+        size_t end = std::min(tokens.size(), start + window - 1);
+        windows.push_back({1});
+        windows.back().insert(windows.back().end(), tokens.begin() + start, tokens.begin() + end);
+    }
+
+    n_threads = std::max(1, std::min(n_threads, (int)windows.size()));
+    batch = std::min(batch, window);
+    std::vector<std::unique_ptr<window_runner>> runners;
+    for (int t = 0 ; t < n_threads ; t++) {
+        runners.emplace_back(new window_runner{model, window, batch});
+    }
+
+    // window w goes to thread w % n_threads, whose sum is added up at the end
+    std::vector<double> nll(n_threads, 0.0);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0 ; t < n_threads ; t++) {
+        threads.emplace_back([&, t] {
+            for (size_t w = t ; w < windows.size() ; w += n_threads) {
+                nll[t] += runners[t]->run(windows[w]);
+            }
+        });
+    }
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double total = 0.0;
+    for (double n : nll) { total += n; }
+
+    size_t predicted = tokens.size(); // every text token, given BOS and the ones before it in its window
+    printf("tokens: %zu in %zu windows of %d, %d threads, batch %d\n", predicted, windows.size(), window, n_threads, batch);
+    printf("perplexity: %.4f (%.4f nats per token)\n", exp(total / predicted), total / predicted);
+    printf("achieved tok/s: %.1f\n", predicted / seconds);
+    return 0;
+}
@@ -0,0 +1,245 @@
+#ifndef __llama2_generator_h
+#define __llama2_generator_h
+
+#include "llama2.h"
+#include "sampler.h"
+#include "paged_kv_cache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+// ----------------------------------------------------------------------------
+// Several completions of one prompt. prefill() runs the prompt once; sample() and
+// beam_search() then fork its sequence into branches sharing the prompt's kv
+// cache copy-on-write, and decode all the branches of a step as one batch, so
+// every weight is read once per step for all of them. Memory and prefill cost
+// of n completions stay close to those of one.
+//
+// The generator points into the model's weights: build it after fusing and after
+// loading the first adapter, and leave the model alone while it exists.
+
+class generator {
+    llama2& model;
+    int max_branches;
+    paged_kv_cache cache;
+    graph program;       // the batched forward pass over the paged cache
+    int prompt = -1;     // sequence of the prefilled prompt
+    int prompt_length = 0;
+    int adapter = -1;    // of the prompt and all its branches
+    std::vector<float> prompt_logits; // for the token after the prompt
+
+    void build() {
+        graph::value x = program.embedding(model.embedding_table());
+        for (int l = 0 ; l < model.config.n_layers ; l++) {
+            program.set_layer(l);
+            x = model.layer(l).build(program, x, cache);
+        }
+
+        program.set_layer(-1);
+        program.output(program.linear(program.rms_norm(x, model.final_norm()), model.classifier(), "classifier"));
+        program.compile(max_branches);
+    }
+
+    // the cache needs the prompt once and every branch's own copy of the blocks it writes
+    static int blocks_needed(const Config& c, int max_branches, int block_size) {
+        int per_sequence = (c.seq_len + block_size - 1) / block_size;
+        return per_sequence + 2 * max_branches * per_sequence;
+    }
+
+public:
+    struct hypothesis {
+        std::vector<int> tokens;
+        float log_prob;  // of the tokens given the prompt
+        float score;     // log_prob with the length penalty
+    };
+
+    // up to max_branches branches decoded together, kv cache blocks of block_size positions
+    generator(llama2& model, int max_branches, int block_size = 16)
+    : model{model}, max_branches{std::max(1, max_branches)},
+      cache{model.config.n_layers, model.layer(0).kv_width(), block_size,
+            blocks_needed(model.config, std::max(1, max_branches), block_size)} {
+        build();
+    }
+
+    // run the prompt with a LoRA adapter of the model (-1 for none), the branches of
+    // sample() and beam_search() start after it with the same adapter
+    void prefill(const std::vector<int>& tokens, int adapter = -1) {
+        if (tokens.empty() || (int)tokens.size() >= model.config.seq_len) {
+            fprintf(stderr, "The prompt must have between 1 and %d tokens\n", model.config.seq_len - 1);
+            exit(EXIT_FAILURE);
+        }
+
+        if (prompt >= 0) { cache.release(prompt); }
+        prompt = cache.create();
+        prompt_length = tokens.size();
+        this->adapter = adapter;
+        for (int pos = 0 ; pos < prompt_length ; pos++) {
+            tensor logits = program.run({tokens[pos]}, {pos}, {prompt}, {adapter});
+            if (pos + 1 == prompt_length) {
+                prompt_logits.assign(logits.get_data(), logits.get_data() + logits.size());
+            }
+        }
+    }
+
+    // n completions of at most steps tokens, each with its own sampler seeded seed + i;
+    // a branch ends at the BOS token (= 1), which is not part of its completion
+    std::vector<std::vector<int>> sample(int n, int steps, float temperature, float topp, unsigned long long seed) {
+        n = std::min(n, max_branches);
+        steps = std::min(steps, model.config.seq_len - prompt_length);
+        std::vector<std::vector<int>> completions(n);
+        std::vector<std::unique_ptr<Sampler>> samplers;
+        std::vector<int> branches;    // indices of the branches still going
+        std::vector<int> sequences;   // their kv cache sequences
+        std::vector<int> tokens;      // their last token
+
+        tensor first{{1, model.config.vocab_size}};
+        for (int i = 0 ; i < n ; i++) {
+            samplers.emplace_back(new Sampler{model.config.vocab_size, temperature, topp, seed + i});
+            memcpy(first.get_data(), prompt_logits.data(), prompt_logits.size() * sizeof(float));
+            int token = samplers[i]->sample(first);
+            if (token == 1 || steps == 0) { continue; }
+            completions[i].push_back(token);
+            branches.push_back(i);
+            sequences.push_back(cache.fork(prompt));
+            tokens.push_back(token);
+        }
+
+        std::vector<int> positions;
+        for (int step = 1 ; step < steps && !branches.empty() ; step++) {
+            positions.assign(branches.size(), prompt_length + step - 1);
+            tensor logits = program.run(tokens, positions, sequences, std::vector<int>(branches.size(), adapter));
+
+            // sample every row, then drop the branches that ended
+            size_t kept = 0;
+            for (size_t b = 0 ; b < branches.size() ; b++) {
+                tensor row = logits[b];
+                int token = samplers[branches[b]]->sample(row);
+                if (token == 1) {
+                    cache.release(sequences[b]);
+                    continue;
+                }
+
+                completions[branches[b]].push_back(token);
+                branches[kept] = branches[b];
+                sequences[kept] = sequences[b];
+                tokens[kept] = token;
+                kept++;
+            }
+
+            branches.resize(kept);
+            sequences.resize(kept);
+            tokens.resize(kept);
+        }
+
+        for (int seq : sequences) { cache.release(seq); }
+        return completions;
+    }
+
+    // Beam search: keep the beam_width most likely continuations at every step, up to
+    // steps tokens or the BOS token (= 1). Hypotheses are ranked by log probability
+    // divided by ((5 + length) / 6)^length_penalty, best first; 0 ranks by probability
+    // alone, larger values favour longer hypotheses.
+    std::vector<hypothesis> beam_search(int beam_width, int steps, float length_penalty = 1.0f) {
+        beam_width = std::min(beam_width, max_branches);
+        steps = std::min(steps, model.config.seq_len - prompt_length);
+        const int vocab_size = model.config.vocab_size;
+        auto score = [&](float log_prob, size_t length) {
+            return log_prob / powf((5.0f + length) / 6.0f, length_penalty);
+        };
+
+        struct beam {
+            int sequence;
+            std::vector<int> tokens;
+            float log_prob;
+        };
+
+        struct candidate {
+            int parent;
+            int token;
+            float log_prob;
+        };
+
+        std::vector<beam> beams = {{cache.fork(prompt), {}, 0.0f}};
+        std::vector<hypothesis> finished;
+        std::vector<float> log_probs(vocab_size);
+        std::vector<int> order(vocab_size);
+        // rows of the beams, in the graph's output after the first step (never written to)
+        const float* logits = prompt_logits.data();
+        // 2 * beam_width candidates, so that beam_width go on even if the others end
+        const int proposals = std::min(2 * beam_width, vocab_size);
+        for (int step = 0 ; step < steps && !beams.empty() ; step++) {
+            // the best tokens of every beam hold the best candidates overall
+            std::vector<candidate> candidates;
+            for (size_t b = 0 ; b < beams.size() ; b++) {
+                const float* row = logits + b * vocab_size;
+                float max_val = *std::max_element(row, row + vocab_size);
+                float sum = 0.0f;
+                for (int i = 0 ; i < vocab_size ; i++) {
+                    sum += expf(row[i] - max_val);
+                }
+
+                float log_sum = max_val + logf(sum);
+                for (int i = 0 ; i < vocab_size ; i++) {
+                    log_probs[i] = row[i] - log_sum;
+                    order[i] = i;
+                }
+
+                std::partial_sort(order.begin(), order.begin() + proposals, order.end(),
+                                  [&](int a, int c) { return log_probs[a] > log_probs[c]; });
+                for (int i = 0 ; i < proposals ; i++) {
+                    candidates.push_back({(int)b, order[i], beams[b].log_prob + log_probs[order[i]]});
+                }
+            }
+
+            std::sort(candidates.begin(), candidates.end(),
+                      [](const candidate& a, const candidate& c) { return a.log_prob > c.log_prob; });
+            candidates.resize(std::min<size_t>(candidates.size(), proposals));
+
+            // BOS among the beam_width best ends a hypothesis; the best beam_width others go
+            // on, forking their parent's sequence, then the parents go
+            std::vector<beam> next;
+            for (size_t i = 0 ; i < candidates.size() && (int)next.size() < beam_width ; i++) {
+                const candidate& c = candidates[i];
+                const beam& parent = beams[c.parent];
+                if (c.token == 1) {
+                    if ((int)i < beam_width) {
+                        finished.push_back({parent.tokens, c.log_prob, score(c.log_prob, parent.tokens.size() + 1)});
+                    }
+                    continue;
+                }
+
+                next.push_back({cache.fork(parent.sequence), parent.tokens, c.log_prob});
+                next.back().tokens.push_back(c.token);
+            }
+
+            for (const beam& b : beams) { cache.release(b.sequence); }
+            beams = std::move(next);
+            if ((int)finished.size() >= beam_width || beams.empty() || step + 1 == steps) { break; }
+
+            std::vector<int> tokens, positions, sequences;
+            for (const beam& b : beams) {
+                tokens.push_back(b.tokens.back());
+                positions.push_back(prompt_length + b.tokens.size() - 1);
+                sequences.push_back(b.sequence);
+            }
+
+            logits = program.run(tokens, positions, sequences, std::vector<int>(beams.size(), adapter)).get_data();
+        }
+
+        for (const beam& b : beams) {
+            finished.push_back({b.tokens, b.log_prob, score(b.log_prob, b.tokens.size())});
+            cache.release(b.sequence);
+        }
+
+        std::sort(finished.begin(), finished.end(),
+                  [](const hypothesis& a, const hypothesis& b) { return a.score > b.score; });
+        return finished;
+    }
+
+    int blocks_allocated() const { return cache.blocks_allocated(); }
+    int block_length() const { return cache.block_length(); }
+};
+
+#endif
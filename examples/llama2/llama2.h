@@ -1,8 +1,16 @@
+#ifndef __llama2_llama2_h
+#define __llama2_llama2_h
+
 #include "mathlib.h"
 #include "tensor.h"
+#include "graph.h"
+#include "trace.h"
 
 #include "nn/embedding.h"
 #include "attention.h"
+#include "streamer.h"
+#include "memory.h"
+#include "communicator.h"
 
 #include <cstdio>
 #include <cstdlib>
@@ -13,36 +21,80 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <iostream>
+#include <vector>
 
 class llama2 {
     embedding token_embedding_table;
-    attention* multi_head_attention;
+    attention* multi_head_attention = nullptr;
     tensor wcls;
     tensor rms_final_weight;
+    layer_streamer streamer; // optional out-of-core streaming of the layer weights
+    graph program; // the forward pass, rebuilt whenever the weights it points to change
+    shm_communicator* comm = nullptr; // tensor parallel group, when sharded
+    int vocab_offset = 0; // first classifier row of this rank
+    lora_bank adapters; // fine-tunes over the shared weights, see load_adapter
+    int active_adapter = -1; // of forward()
 
     // some more state needed to properly clean up the memory mapping (sigh)
-    int fd; // file descriptor for memory mapping
-    float* data; // memory mapped data pointer
+    int fd = -1; // file descriptor for memory mapping
+    float* data = (float*)MAP_FAILED; // memory mapped data pointer
     ssize_t file_size; // size of the checkpoint file in bytes
+    // the kv caches of a restored session, mapped from its file
+    void* session_map = MAP_FAILED;
+    size_t session_bytes = 0;
+
+    void unmap_session() {
+        if (session_map != MAP_FAILED) {
+            munmap(session_map, session_bytes);
+            memory::on_release(memory::category::kv_cache, session_bytes);
+            session_map = MAP_FAILED;
+        }
+    }
+
+    void check_session_support() const {
+        if (comm || multi_head_attention[0].sliding_window()) {
+            fprintf(stderr, "Sessions are not supported with tensor parallelism or the sliding window\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 public:
     Config config; // the hyperparameters of the architecture (the blueprint)
+    dtype weight_type = dtype::f32; // storage type of the weights in the checkpoint
     llama2() {};
 
+    // only reads the checkpoint: fuse_projections() or enable_streaming() is the caller's choice
     llama2(char* checkpoint_path) {
         read_checkpoint(checkpoint_path);
     }
 
     ~llama2() {
+        streamer.disable();
         delete[] multi_head_attention;
+        unmap_session();
         // close the memory mapping
-        if ((void *)data != MAP_FAILED) { munmap(data, file_size); }
+        if ((void *)data != MAP_FAILED) {
+            munmap(data, file_size);
+            memory::on_release(memory::category::weights, file_size);
+        }
         if (fd != -1) { close(fd); }
     }
 
     void read_checkpoint(char* checkpoint_path) {
         FILE *file = fopen(checkpoint_path, "rb");
         if (!file) { fprintf(stderr, "Couldn't open file %s\n", checkpoint_path); exit(EXIT_FAILURE); }
+        // checkpoints with half precision weights start with a small header, legacy ones with the config
+        CheckpointHeader header;
+        size_t header_size = 0;
+        if (fread(&header, sizeof(CheckpointHeader), 1, file) == 1 && header.magic == CHECKPOINT_MAGIC) {
+            if (header.version != CHECKPOINT_VERSION) { fprintf(stderr, "Unsupported checkpoint version %d\n", header.version); exit(EXIT_FAILURE); }
+            weight_type = (dtype)header.dtype;
+            header_size = sizeof(CheckpointHeader);
+        } else {
+            weight_type = dtype::f32;
+        }
+        fseek(file, header_size, SEEK_SET);
         // read in the config header
         if (fread(&config, sizeof(Config), 1, file) != 1) { exit(EXIT_FAILURE); }
         // negative vocab size is hacky way of signaling unshared weights. bit yikes.
@@ -58,76 +110,372 @@ public:
         if (fd == -1) { fprintf(stderr, "open failed!\n"); exit(EXIT_FAILURE); }
         data = (float *)mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
         if ((void *)data == MAP_FAILED) { fprintf(stderr, "mmap failed!\n"); exit(EXIT_FAILURE); }
-        float* weights = data + sizeof(Config)/sizeof(float);
+        memory::on_allocate(memory::category::weights, file_size); // not resident until touched, but ours to use
+        char* weights = (char*)data + header_size + sizeof(Config);
+        size_t elem_size = dtype_size(weight_type);
 
         // memory map the Transformer weights into the data pointers
+        streamer.init(fd, data, config.n_layers);
         multi_head_attention = new attention[config.n_layers];
         for (int i = 0 ; i < config.n_layers; i++) {
-            multi_head_attention[i] = attention(config);
+            multi_head_attention[i] = attention(config, i);
         }
 
         int head_size = config.dim / config.n_heads;
 
-        token_embedding_table = embedding(weights, config.vocab_size, config.dim);
-        weights += token_embedding_table.size();
+        token_embedding_table = embedding(weights, config.vocab_size, config.dim, weight_type);
+        weights += token_embedding_table.size() * elem_size;
 
         for (int i = 0 ; i < config.n_layers; i++) {
-            auto sz = multi_head_attention[i].set_rms_att_weight(weights);
-            weights += sz;
+            auto sz = multi_head_attention[i].set_rms_att_weight(weights, weight_type);
+            streamer.add_range(i, weights, sz * elem_size);
+            weights += sz * elem_size;
         }
         for (int i = 0 ; i < config.n_layers; i++) {
-            auto sz = multi_head_attention[i].set_query(weights);
-            weights += sz;
+            auto sz = multi_head_attention[i].set_query(weights, weight_type);
+            streamer.add_range(i, weights, sz * elem_size);
+            weights += sz * elem_size;
         }
         for (int i = 0 ; i < config.n_layers; i++) {
-            auto sz = multi_head_attention[i].set_key(weights);
-            weights += sz;
+            auto sz = multi_head_attention[i].set_key(weights, weight_type);
+            streamer.add_range(i, weights, sz * elem_size);
+            weights += sz * elem_size;
         }
         for (int i = 0 ; i < config.n_layers; i++) {
-            auto sz = multi_head_attention[i].set_value(weights);
-            weights += sz;
+            auto sz = multi_head_attention[i].set_value(weights, weight_type);
+            streamer.add_range(i, weights, sz * elem_size);
+            weights += sz * elem_size;
         }
         for (int i = 0 ; i < config.n_layers; i++) {
-            auto sz = multi_head_attention[i].set_weight_o(weights);
-            weights += sz;
+            auto sz = multi_head_attention[i].set_weight_o(weights, weight_type);
+            streamer.add_range(i, weights, sz * elem_size);
+            weights += sz * elem_size;
         }
         for (int i = 0 ; i < config.n_layers; i++) {
-            auto sz = multi_head_attention[i].set_rms_ffn_weight(weights);
-            weights += sz;
+            auto sz = multi_head_attention[i].set_rms_ffn_weight(weights, weight_type);
+            streamer.add_range(i, weights, sz * elem_size);
+            weights += sz * elem_size;
         }
         for (int i = 0 ; i < config.n_layers; i++) {
-            auto sz = multi_head_attention[i].set_ffn_weights1(weights);
-            weights += sz;
+            auto sz = multi_head_attention[i].set_ffn_weights1(weights, weight_type);
+            streamer.add_range(i, weights, sz * elem_size);
+            weights += sz * elem_size;
         }
         for (int i = 0 ; i < config.n_layers; i++) {
-            auto sz = multi_head_attention[i].set_ffn_weights2(weights);
-            weights += sz;
+            auto sz = multi_head_attention[i].set_ffn_weights2(weights, weight_type);
+            streamer.add_range(i, weights, sz * elem_size);
+            weights += sz * elem_size;
         }
         for (int i = 0 ; i < config.n_layers; i++) {
-            auto sz = multi_head_attention[i].set_ffn_weights3(weights);
-            weights += sz;
+            auto sz = multi_head_attention[i].set_ffn_weights3(weights, weight_type);
+            streamer.add_range(i, weights, sz * elem_size);
+            weights += sz * elem_size;
         }
 
-        rms_final_weight = tensor{weights, {1, config.dim}};
-        weights += config.dim;
+        {
+            memory::scope final_weights{memory::category::weights};
+            rms_final_weight = tensor{weights, {1, config.dim}, weight_type}.to(dtype::f32);
+        }
+        weights += config.dim * elem_size;
 
-        weights += config.seq_len * head_size / 2; // skip what used to be freq_cis_real (for RoPE)
-        weights += config.seq_len * head_size / 2; // skip what used to be freq_cis_imag (for RoPE)
+        weights += config.seq_len * head_size / 2 * elem_size; // skip what used to be freq_cis_real (for RoPE)
+        weights += config.seq_len * head_size / 2 * elem_size; // skip what used to be freq_cis_imag (for RoPE)
         
-        wcls = shared_weights ? token_embedding_table : tensor{weights, {config.vocab_size, config.dim}};
+        // the shared classifier is a view of the embedding table, not a copy of it
+        wcls = shared_weights ? token_embedding_table.to(weight_type) : tensor{weights, {config.vocab_size, config.dim}, weight_type};
         weights = nullptr;
+        build_graph();
     }
 
-    tensor forward(int token, int pos) {
-        tensor emb = token_embedding_table(token);
-        tensor x = emb.copy();
+    // the whole forward pass as one graph: embedding, the layers, final norm and classifier
+    void build_graph() {
+        program = graph();
+        graph::value x = program.embedding(token_embedding_table);
+        for (int l = 0 ; l < config.n_layers ; l++) {
+            program.set_layer(l);
+            program.hook([this, l] { streamer.enter_layer(l); });
+            x = multi_head_attention[l].build(program, x);
+        }
+
+        program.set_layer(-1);
+        x = program.rms_norm(x, rms_final_weight);
+        x = program.linear(x, wcls, "classifier");
+        if (comm) { x = program.all_gather(x, *comm, vocab_offset, config.vocab_size); }
+        program.output(x);
+        program.compile();
+    }
+
+    // Tensor parallel: this process becomes rank comm.rank() of comm.size(), every rank
+    // keeping only its shard of each layer (see attention::shard) and of the classifier
+    // rows. The ranks run the same forward passes in lockstep and all get the full
+    // logits. Call right after read_checkpoint, before fusing; not for streaming.
+    void shard(shm_communicator& comm) {
+        int rank = comm.rank();
+        int n_ranks = comm.size();
+        if (config.n_kv_heads % n_ranks != 0 || config.hidden_dim % n_ranks != 0) {
+            fprintf(stderr, "%d ranks do not split %d kv heads and %d hidden units evenly\n",
+                    n_ranks, config.n_kv_heads, config.hidden_dim);
+            exit(EXIT_FAILURE);
+        }
+
+        if (n_ranks == 1) { return; }
+        for (int l = 0 ; l < config.n_layers ; l++) {
+            multi_head_attention[l].shard(rank, n_ranks, comm);
+        }
+
+        vocab_offset = (long)config.vocab_size * rank / n_ranks;
+        int vocab_rows = (long)config.vocab_size * (rank + 1) / n_ranks - vocab_offset;
+        char* rows = wcls.type() == dtype::f32 ? (char*)wcls.get_data() : (char*)wcls.get_half_data();
+        wcls = tensor{rows + (size_t)vocab_offset * config.dim * dtype_size(weight_type), {vocab_rows, config.dim}, weight_type};
+        this->comm = &comm;
+        build_graph();
+    }
+
+    const graph& forward_graph() const { return program; }
+
+    // the parts of the model, to build other graphs over the same weights
+    attention& layer(int l) { return multi_head_attention[l]; }
+    const embedding& embedding_table() const { return token_embedding_table; }
+    const tensor& final_norm() const { return rms_final_weight; }
+    const tensor& classifier() const { return wcls; }
+
+    // one matmul for q, k and v and one for the SwiGLU gate and up projections in every
+    // layer. Costs a copy of those weights in memory, so not used while streaming.
+    void fuse_projections() {
+        for (int l = 0 ; l < config.n_layers ; l++) {
+            multi_head_attention[l].fuse_projections();
+        }
+
+        build_graph();
+    }
+
+    // stream the layer weights from disk instead of relying on the page cache, keeping
+    // at most resident_budget bytes of them in memory (the current and next layer are
+    // always kept). Useful when the checkpoint does not fit in RAM. Drops the fused
+    // projections, which would keep a copy of most of the weights resident.
+    void enable_streaming(size_t resident_budget) {
+        for (int l = 0 ; l < config.n_layers ; l++) {
+            multi_head_attention[l].unfuse_projections();
+        }
+
+        build_graph();
+        streamer.enable(resident_budget);
+    }
+
+    bool streaming() const { return streamer.is_enabled(); }
+
+    // Attention sinks: keep the first sinks tokens plus a rolling window of the most
+    // recent ones in every layer's kv cache, which turns into a ring buffer. Memory and
+    // time per token stay constant and forward() takes any position, not only those
+    // below seq_len. -1 goes back to the plain cache.
+    void enable_sliding_window(int sinks) {
+        if (sinks >= config.seq_len) {
+            fprintf(stderr, "%d attention sinks leave no window in a cache of %d\n", sinks, config.seq_len);
+            exit(EXIT_FAILURE);
+        }
+
+        for (int l = 0 ; l < config.n_layers ; l++) {
+            multi_head_attention[l].set_sliding_window(sinks);
+        }
+
+        build_graph();
+    }
+
+    // Sparse FFN: the down projection of every layer only reads the weights of hidden
+    // activations with |h| > threshold, or of the top_k largest ones if top_k > 0, see
+    // attention::set_sparse_ffn. Negative threshold and no top_k for the dense matmul.
+    // The fraction kept is forward_graph().sparse_density().
+    void enable_sparse_ffn(float threshold, int top_k = 0) {
+        for (int l = 0 ; l < config.n_layers ; l++) {
+            multi_head_attention[l].set_sparse_ffn(threshold, top_k);
+        }
+
+        build_graph();
+    }
+
+    // Load a LoRA adapter file (see LoraHeader), its id for use_adapter and the runs of
+    // other graphs. The checkpoint weights stay shared: any number of adapters only cost
+    // their low-rank pairs. Adapters can be loaded and unloaded between forward passes;
+    // the first one rebuilds the graph with the lora ops. Not with tensor parallelism.
+    int load_adapter(const char* path) {
+        if (comm) {
+            fprintf(stderr, "Adapters are not supported on a sharded model\n");
+            exit(EXIT_FAILURE);
+        }
+
+        FILE* file = fopen(path, "rb");
+        if (!file) { fprintf(stderr, "Couldn't open file %s\n", path); exit(EXIT_FAILURE); }
+        LoraHeader header;
+        if (fread(&header, sizeof(LoraHeader), 1, file) != 1 || header.magic != LORA_MAGIC ||
+            header.version != LORA_VERSION || header.rank <= 0) {
+            fprintf(stderr, "%s is not a LoRA adapter file\n", path);
+            exit(EXIT_FAILURE);
+        }
+
+        if (header.rank > lora_bank::max_supported_rank) {
+            fprintf(stderr, "%s has rank %d, at most %d is supported\n", path, header.rank, lora_bank::max_supported_rank);
+            exit(EXIT_FAILURE);
+        }
+
+        int head_size = config.dim / config.n_heads;
+        int kv_dim = config.n_kv_heads * head_size;
+        int id = adapters.create();
+        memory::scope weights{memory::category::weights};
+        for (int i = 0 ; i < header.n_pairs ; i++) {
+            LoraPairHeader pair;
+            if (fread(&pair, sizeof(LoraPairHeader), 1, file) != 1 || pair.layer < 0 || pair.layer >= config.n_layers ||
+                pair.target < 0 || pair.target >= (int)lora_target::count) {
+                fprintf(stderr, "Bad pair %d in %s\n", i, path);
+                exit(EXIT_FAILURE);
+            }
+
+            // in and out of the projection, as in attention's set_* methods
+            lora_target target = (lora_target)pair.target;
+            int in = target == lora_target::weight2 ? config.hidden_dim : config.dim;
+            int out = config.dim;
+            if (target == lora_target::key || target == lora_target::value) { out = kv_dim; }
+            if (target == lora_target::weight1 || target == lora_target::weight3) { out = config.hidden_dim; }
+
+            tensor a{{header.rank, in}};
+            tensor b{{out, header.rank}};
+            if (fread(a.get_data(), sizeof(float), a.size(), file) != a.size() ||
+                fread(b.get_data(), sizeof(float), b.size(), file) != b.size()) {
+                fprintf(stderr, "%s is truncated\n", path);
+                exit(EXIT_FAILURE);
+            }
+
+            adapters.set(id, attention::lora_slot(pair.layer, target), std::move(a), std::move(b),
+                         header.alpha / header.rank);
+        }
+
+        fclose(file);
+        if (adapters.size() == 1) {
+            for (int l = 0 ; l < config.n_layers ; l++) {
+                multi_head_attention[l].set_adapters(&adapters);
+            }
+
+            build_graph();
+        }
+
+        return id;
+    }
+
+    void unload_adapter(int id) {
+        adapters.release(id);
+        if (active_adapter == id) { active_adapter = -1; }
+    }
+
+    // the adapter of the following forward passes, -1 for the base model
+    void use_adapter(int id) { active_adapter = id; }
+
+    // where a session stands: pos positions are in the kv cache, token runs next
+    struct session {
+        int pos;
+        int token;
+        unsigned long long rng_state; // of the sampler
+    };
 
+    // Write the kv cache of the first s.pos positions and the rest of s to path, so
+    // that restore_session resumes there without running the tokens again.
+    void save_session(const char* path, const session& s) {
+        check_session_support();
+        if (s.pos < 0 || s.pos > config.seq_len) {
+            fprintf(stderr, "No session at position %d\n", s.pos);
+            exit(EXIT_FAILURE);
+        }
+
+        // the caches may be mapped from the file at path: write another one and rename
+        // it over, so that the mapped pages stay with the old inode while we read them
+        std::string temporary = std::string(path) + ".tmp";
+        FILE* file = fopen(temporary.c_str(), "wb");
+        if (!file) { fprintf(stderr, "Couldn't create %s\n", temporary.c_str()); exit(EXIT_FAILURE); }
+        const long page = sysconf(_SC_PAGESIZE);
+        const int kv_dim = multi_head_attention[0].cache_shape().second;
+        SessionHeader header{SESSION_MAGIC, SESSION_VERSION, config, kv_dim, (int)page, s.pos, s.token, s.rng_state,
+                             (long long)file_size};
+        std::vector<char> padding(page, 0);
+        fwrite(&header, sizeof(SessionHeader), 1, file);
+        fwrite(padding.data(), 1, page - sizeof(SessionHeader), file);
+
+        const size_t bytes = (size_t)s.pos * kv_dim * sizeof(float);
+        const size_t padded = (bytes + page - 1) / page * page;
         for (int l = 0 ; l < config.n_layers ; l++) {
-            x = multi_head_attention[l].forward(x, pos);
+            for (const tensor* cache : {&multi_head_attention[l].keys(), &multi_head_attention[l].values()}) {
+                fwrite(cache->get_data(), 1, bytes, file);
+                fwrite(padding.data(), 1, padded - bytes, file);
+            }
         }
 
-        x = rms_norm(x, rms_final_weight);
-        x = x * wcls;
-        return x;
+        if (fclose(file) != 0 || rename(temporary.c_str(), path) != 0) {
+            fprintf(stderr, "Couldn't write %s\n", path);
+            exit(EXIT_FAILURE);
+        }
     }
-};
\ No newline at end of file
+
+    // Continue a session saved by save_session with this checkpoint: the caches of every
+    // layer are mapped copy-on-write from the file in place of their own memory, which
+    // costs a few page faults instead of a prefill. Returns where to carry on.
+    session restore_session(const char* path) {
+        check_session_support();
+        int session_fd = open(path, O_RDONLY);
+        if (session_fd == -1) { fprintf(stderr, "Couldn't open file %s\n", path); exit(EXIT_FAILURE); }
+        const long page = sysconf(_SC_PAGESIZE);
+        const int kv_dim = multi_head_attention[0].cache_shape().second;
+        SessionHeader header;
+        if (read(session_fd, &header, sizeof(SessionHeader)) != sizeof(SessionHeader) || header.magic != SESSION_MAGIC ||
+            header.version != SESSION_VERSION) {
+            fprintf(stderr, "%s is not a session file\n", path);
+            exit(EXIT_FAILURE);
+        }
+
+        if (memcmp(&header.config, &config, sizeof(Config)) != 0 || header.kv_dim != kv_dim ||
+            header.checkpoint_bytes != file_size || header.page_size != page ||
+            header.n_tokens < 0 || header.n_tokens > config.seq_len) {
+            fprintf(stderr, "%s was saved with another model\n", path);
+            exit(EXIT_FAILURE);
+        }
+
+        // one anonymous region for all the caches, the saved rows mapped over its start
+        const size_t cache_bytes = ((size_t)config.seq_len * kv_dim * sizeof(float) + page - 1) / page * page;
+        const size_t saved = ((size_t)header.n_tokens * kv_dim * sizeof(float) + page - 1) / page * page;
+        const size_t total = 2 * config.n_layers * cache_bytes;
+        struct stat file_stat;
+        if (fstat(session_fd, &file_stat) != 0 || (size_t)file_stat.st_size < page + 2 * config.n_layers * saved) {
+            fprintf(stderr, "%s is truncated\n", path);
+            exit(EXIT_FAILURE);
+        }
+
+        char* region = (char*)mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) { fprintf(stderr, "mmap failed!\n"); exit(EXIT_FAILURE); }
+        for (int i = 0 ; i < 2 * config.n_layers && saved > 0 ; i++) {
+            void* rows = mmap(region + i * cache_bytes, saved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                              session_fd, page + i * saved);
+            if (rows == MAP_FAILED) { fprintf(stderr, "mmap of %s failed!\n", path); exit(EXIT_FAILURE); }
+        }
+
+        close(session_fd); // the mappings hold on to the file
+        for (int l = 0 ; l < config.n_layers ; l++) {
+            multi_head_attention[l].set_cache((float*)(region + 2 * l * cache_bytes),
+                                              (float*)(region + (2 * l + 1) * cache_bytes));
+        }
+
+        // the caches now live in the new region, the previous session can go
+        unmap_session();
+        session_map = region;
+        session_bytes = total;
+        memory::on_allocate(memory::category::kv_cache, total);
+        return {header.n_tokens, header.token, header.rng_state};
+    }
+
+    void disable_streaming() {
+        streamer.disable();
+    }
+
+    // logits for the next token, a view valid until the next call
+    tensor forward(int token, int pos) {
+        TRACE_SCOPE("forward");
+        return program.run(token, pos, active_adapter);
+    }
+};
+
+#endif
@@ -3,7 +3,16 @@
 #include <iostream>
 #include <vector>
 #include "sampler.h"
+#include "trace.h"
+#include "memory.h"
+#include "communicator.h"
+#include "generator.h"
+#include "constraint.h"
+#include "token_stream.h"
 #include <ctime>
+#include <memory>
+#include <string>
+#include <sys/wait.h>
 
 // ----------------------------------------------------------------------------
 // utilities: time
@@ -20,14 +29,63 @@ int main (int argc, char *argv[]) {
     float topp = 0.9f;          // top-p in nucleus sampling. 1.0 = off. 0.9 works well, but slower
     int steps = 256;            // number of steps to run for
     unsigned long long rng_seed = 0; // seed rng with time by default
+    long stream_budget = -1;    // bytes of layer weights kept resident when streaming. -1 = off (plain mmap)
+    int tp_ranks = 1;           // processes splitting every layer between them (tensor parallel). 1 = off
+    float ffn_threshold = -1.0f; // >= 0: FFN down projection over hidden activations above this only. -1 = dense
+    int ffn_top_k = 0;          // > 0: over the ffn_top_k largest hidden activations only
+    int sink_tokens = -1;       // >= 0: kv cache of these first tokens plus the most recent ones, for steps past seq_len. -1 = off
+    int n_samples = 1;          // > 1: that many completions of the prompt, decoded together
+    int beam_width = 0;         // > 0: beam search with that many beams instead of sampling
+    float length_penalty = 1.0f; // of beam search, larger favours longer completions
+    bool json_mode = false;     // the completion is constrained to one JSON value
+    std::vector<std::string> stop_strings; // the completion ends before the first of these
+    const char* session_path = nullptr; // resume from this session file when it exists, save to it at the end
+    const char* adapter_path = nullptr; // LoRA adapter file applied over the checkpoint weights. nullptr = base model
 
     if (rng_seed <= 0) rng_seed = (unsigned int)time(NULL);
     if (temperature < 0.0) temperature = 0.0;
     if (topp < 0.0 || 1.0 < topp) topp = 0.9;
     if (steps < 0) steps = 0;
+    // the branches of the generator share one kv cache, within one process
+    if (n_samples > 1 || beam_width > 0) tp_ranks = 1;
+    // the constraint follows the one sequence of the main loop
+    if (json_mode) { n_samples = 1; beam_width = 0; }
 
     char *model_path = argv[1];
-    llama2 model{model_path};
+    llama2 model;
+    model.read_checkpoint(model_path);
+
+    // tensor parallel: fork the other ranks, which run the same loop on their shard
+    // of the weights and sample the same tokens from the same logits, silently
+    int rank = 0;
+    std::unique_ptr<shm_communicator> comm;
+    if (tp_ranks > 1) {
+        std::string name = "/tinyinference-" + std::to_string(getpid());
+        size_t max_floats = std::max(model.config.dim, model.config.vocab_size);
+        comm.reset(new shm_communicator(name.c_str(), tp_ranks, max_floats));
+        fflush(stdout);
+        for (int r = 1 ; r < tp_ranks && rank == 0 ; r++) {
+            if (fork() == 0) { rank = r; }
+        }
+
+        comm->set_rank(rank);
+        if (rank != 0) {
+            if (!freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr)) { exit(EXIT_FAILURE); }
+        }
+
+        model.shard(*comm);
+        stream_budget = -1; // the streamer would bring in every rank's rows
+    }
+
+    // fusing copies the projection weights, streaming is for when they don't fit in memory
+    if (stream_budget >= 0) model.enable_streaming(stream_budget);
+    else model.fuse_projections();
+    // without the sliding window the kv cache ends at seq_len
+    if (sink_tokens >= 0) model.enable_sliding_window(sink_tokens);
+    else if (steps > model.config.seq_len) steps = model.config.seq_len;
+    if (ffn_threshold >= 0.0f || ffn_top_k > 0) model.enable_sparse_ffn(ffn_threshold, ffn_top_k);
+    int adapter = adapter_path ? model.load_adapter(adapter_path) : -1;
+    model.use_adapter(adapter);
     Sampler sampler{model.config.vocab_size, temperature, topp, rng_seed};
 
     std::string prompt = "";
@@ -38,12 +96,62 @@ int main (int argc, char *argv[]) {
     bpe tokenizer("tokenizer.bin", vocab_size);
     std::vector<int> prompt_tokens = tokenizer.encode(prompt, 1, 0);
     num_prompt_tokens = prompt_tokens.size();
+    std::unique_ptr<token_constraint<json_grammar>> constraint;
+    if (json_mode) constraint.reset(new token_constraint<json_grammar>{tokenizer, vocab_size});
+
+    // several completions: the prompt runs once, the branches share its kv cache
+    if (n_samples > 1 || beam_width > 0) {
+        generator gen{model, std::max(n_samples, beam_width)};
+        gen.prefill(prompt_tokens, adapter);
+        int completion_steps = std::max(0, steps - num_prompt_tokens);
+        auto print_completion = [&](int i, const std::vector<int>& tokens) {
+            printf("[%d] ", i);
+            int prev = prompt_tokens.back();
+            for (int next : tokens) {
+                tokenizer.safe_printf(tokenizer.decode(prev, next));
+                prev = next;
+            }
+
+            printf("\n");
+        };
+
+        if (beam_width > 0) {
+            std::vector<generator::hypothesis> beams = gen.beam_search(beam_width, completion_steps, length_penalty);
+            for (size_t i = 0 ; i < beams.size() ; i++) {
+                print_completion(i, beams[i].tokens);
+                fprintf(stderr, "[%zu] log prob %f, score %f\n", i, beams[i].log_prob, beams[i].score);
+            }
+        } else {
+            std::vector<std::vector<int>> completions = gen.sample(n_samples, completion_steps, temperature, topp, rng_seed);
+            for (int i = 0 ; i < n_samples ; i++) {
+                print_completion(i, completions[i]);
+            }
+        }
+
+        memory::print_report(stderr);
+        fprintf(stderr, "kv cache: %d blocks of %d positions\n", gen.blocks_allocated(), gen.block_length());
+        return 0;
+    }
 
     // start the main loop
     long start = 0;  // used to time our code, only initialized after first iteration
     int next;        // will store the next token in the sequence
     int token = prompt_tokens[0]; // kick off with the first token in the prompt
     int pos = 0;     // position in the sequence
+    if (session_path && access(session_path, F_OK) == 0) {
+        // the kv cache of the positions run before is mapped back, no prefill
+        llama2::session s = model.restore_session(session_path);
+        pos = s.pos;
+        token = s.token;
+        sampler.set_rng_state(s.rng_state);
+    }
+
+    // print the tokens as strings, the stream already dropped the "unsafe" bytes
+    token_stream stream{tokenizer, [&](const std::string& piece) {
+        fwrite(piece.data(), 1, piece.size(), stdout);
+        fflush(stdout);
+    }, stop_strings};
+
     while (pos < steps) {
         // forward the transformer to get logits for the next token
         tensor logits = model.forward(token, pos);
@@ -53,27 +161,55 @@ int main (int argc, char *argv[]) {
             next = prompt_tokens[pos + 1];
         } else {
             // otherwise sample the next token from the logits
-            next = sampler.sample(logits);
+            next = constraint ? sampler.sample(logits, constraint->allowed()) : sampler.sample(logits);
         }
         
+        if (constraint && pos >= num_prompt_tokens - 1) {
+            if (next == 2) { next = 1; } // EOS ends the value as BOS would
+            else if (next != 1) { constraint->accept(next); }
+        }
+
         pos++;
 
         // data-dependent terminating condition: the BOS (=1) token delimits sequences
-        if (next == 1) { break; }
-        // print the token as string, decode it with the Tokenizer object
-        std::string piece = tokenizer.decode(token, next);
-        tokenizer.safe_printf(piece); // same as printf("%s", piece), but skips "unsafe" bytes
-        fflush(stdout);
+        if (next == 1) { token = next; break; }
+        // the stream's thread decodes and prints it while the next forward runs
+        stream.push(token, next);
         token = next;
+        if (stream.stopped()) { break; }
         // init the timer here because the first iteration can be slower
         if (start == 0) { start = time_in_ms(); }
     }
 
+    stream.finish();
+    if (session_path) { model.save_session(session_path, {pos, token, sampler.get_rng_state()}); }
+
     // report achieved tok/s (pos-1 because the timer starts after first iteration)
     if (pos > 1) {
         long end = time_in_ms();
         fprintf(stderr, "achieved tok/s: %f\n", (pos-1) / (double)(end-start)*1000);
     }
 
+    // live and peak bytes per category (weights include the whole mmap'd checkpoint)
+    memory::print_report(stderr);
+    fprintf(stderr, "forward graph workspace: %zu bytes (%zu without buffer reuse)\n",
+            model.forward_graph().workspace_bytes(), model.forward_graph().unplanned_bytes());
+    if (ffn_threshold >= 0.0f || ffn_top_k > 0) {
+        fprintf(stderr, "sparse ffn: %.1f%% of the down projection rows read\n", 100.0 * model.forward_graph().sparse_density());
+    }
+
+#ifdef TINYINFERENCE_TRACING
+    // per-op profile of the run: a chrome://tracing file and a summary on stderr
+    const char* trace_path = "trace.json";
+    if (rank == 0) {
+        trace::write_chrome_trace(trace_path);
+        trace::print_summary(stderr);
+    }
+#endif
+
+    if (comm && rank == 0) {
+        while (wait(nullptr) > 0) {} // the other ranks, before the segment goes away
+    }
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,206 @@
+#ifndef __llama2_pipeline_h
+#define __llama2_pipeline_h
+
+#include "llama2.h"
+#include "spsc_queue.h"
+
+#include <memory>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+
+// ----------------------------------------------------------------------------
+// Pipeline-parallel decoding of several sequences at once. The layers are split
+// into stages, each run by one thread pinned to a core of its own (a stage is
+// one thread, a group of cores would only let it migrate), so a stage keeps its
+// layers' weights hot in that core's caches. Sequences travel through
+// the stages in micro-batches: while stage 1 runs the layers of micro-batch 0,
+// stage 0 already works on micro-batch 1. Stages hand micro-batches over through
+// lock-free single producer / single consumer queues, and an idle stage sleeps
+// in its queue; the activations themselves are copied into the next stage's
+// input buffer of each sequence.
+//
+// Every sequence has its own kv cache and one graph per stage. The pipeline
+// points into the model's weights: build it after fusing, and leave the model
+// alone while it exists. Streaming is not supported: the streamer follows one
+// forward pass through the layers, while the stages run theirs concurrently.
+
+class pipeline {
+    struct micro_batch {
+        int first = 0;  // sequences [first, first + count)
+        int count = 0;  // 0 tells the stage to stop
+    };
+
+    struct sequence {
+        std::vector<tensor> key_cache;   // per layer
+        std::vector<tensor> value_cache;
+        std::vector<tensor> sink_keys;   // per layer, with a sliding window
+        std::vector<tensor> inputs;      // activations entering each stage after the first
+        std::vector<graph> stages;
+        int token = 0;
+        int pos = 0;
+        tensor logits;                   // view of the last stage's output
+    };
+
+    llama2& model;
+    int n_stages;
+    int batch_size;
+    std::vector<int> first_layer;        // of every stage, plus n_layers at the end
+    std::vector<std::unique_ptr<sequence>> sequences;
+    // queues[s] feeds stage s, queues[n_stages] collects the finished micro-batches
+    std::vector<std::unique_ptr<spsc_queue<micro_batch>>> queues;
+    std::vector<std::thread> threads;
+
+    void build(sequence& seq) {
+        int dim = model.config.dim;
+        memory::scope kv{memory::category::kv_cache};
+        for (int l = 0 ; l < model.config.n_layers ; l++) {
+            seq.key_cache.push_back(tensor{model.layer(l).cache_shape()});
+            seq.value_cache.push_back(tensor{model.layer(l).cache_shape()});
+            seq.sink_keys.push_back(model.layer(l).sink_shape().first > 0 ? tensor{model.layer(l).sink_shape()} : tensor{});
+        }
+
+        seq.inputs.resize(n_stages);
+        seq.stages.resize(n_stages);
+        for (int s = 0 ; s < n_stages ; s++) {
+            graph& g = seq.stages[s];
+            graph::value x;
+            if (s == 0) {
+                x = g.embedding(model.embedding_table());
+            } else {
+                seq.inputs[s] = tensor{{1, dim}};
+                x = g.input(seq.inputs[s]);
+            }
+
+            for (int l = first_layer[s] ; l < first_layer[s + 1] ; l++) {
+                tensor* sinks = seq.sink_keys[l].size() > 0 ? &seq.sink_keys[l] : nullptr;
+                x = model.layer(l).build(g, x, seq.key_cache[l], seq.value_cache[l], sinks);
+            }
+
+            if (s == n_stages - 1) {
+                g.set_layer(-1);
+                x = g.linear(g.rms_norm(x, model.final_norm()), model.classifier(), "classifier");
+            }
+
+            g.output(x);
+            g.compile();
+        }
+
+        seq.logits = seq.stages[n_stages - 1].result();
+    }
+
+    void stage_loop(int s) {
+        spsc_queue<micro_batch>& in = *queues[s];
+        spsc_queue<micro_batch>& out = *queues[s + 1];
+        while (true) {
+            micro_batch batch = in.pop();
+            if (batch.count == 0) {
+                out.push(batch);
+                return;
+            }
+
+            for (int i = batch.first ; i < batch.first + batch.count ; i++) {
+                sequence& seq = *sequences[i];
+                tensor x = seq.stages[s].run(seq.token, seq.pos);
+                if (s + 1 < n_stages) {
+                    memcpy(seq.inputs[s + 1].get_data(), x.get_data(), x.size() * sizeof(float));
+                }
+            }
+
+            out.push(batch);
+        }
+    }
+
+    // one of the cpus this process may run on per stage, round robin
+    std::vector<int> default_cores() const {
+        cpu_set_t set;
+        std::vector<int> cpus;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int c = 0 ; c < CPU_SETSIZE ; c++) {
+                if (CPU_ISSET(c, &set)) { cpus.push_back(c); }
+            }
+        }
+
+        std::vector<int> cores;
+        for (int s = 0 ; s < n_stages && !cpus.empty() ; s++) {
+            cores.push_back(cpus[s % cpus.size()]);
+        }
+
+        return cores;
+    }
+
+    static void pin(std::thread& thread, int core) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set); // best effort
+    }
+
+public:
+    // n_stages is clamped to the number of layers. The thread of stage s is pinned
+    // to cores[s % cores.size()], by default to the cpus we may use in turn.
+    pipeline(llama2& model, int n_stages, int n_sequences, int batch_size = 1,
+             std::vector<int> cores = {})
+    : model{model}, n_stages{std::max(1, std::min(n_stages, model.config.n_layers))},
+      batch_size{std::max(1, batch_size)} {
+        if (model.streaming()) {
+            fprintf(stderr, "The pipeline does not support streaming the weights\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int s = 0 ; s <= this->n_stages ; s++) {
+            first_layer.push_back(model.config.n_layers * s / this->n_stages);
+        }
+
+        for (int i = 0 ; i < n_sequences ; i++) {
+            sequences.emplace_back(new sequence);
+            build(*sequences.back());
+        }
+
+        // a queue never holds more than every micro-batch plus the stop marker
+        size_t capacity = (n_sequences + this->batch_size - 1) / this->batch_size + 1;
+        for (int s = 0 ; s <= this->n_stages ; s++) {
+            queues.emplace_back(new spsc_queue<micro_batch>(capacity));
+        }
+
+        if (cores.empty()) { cores = default_cores(); }
+        for (int s = 0 ; s < this->n_stages ; s++) {
+            threads.emplace_back(&pipeline::stage_loop, this, s);
+            if (!cores.empty()) { pin(threads.back(), cores[s % cores.size()]); }
+        }
+    }
+
+    ~pipeline() {
+        queues[0]->push(micro_batch{});
+        queues[n_stages]->pop(); // the stop marker went through every stage
+        for (std::thread& t : threads) { t.join(); }
+    }
+
+    int size() const { return sequences.size(); }
+    int stages() const { return n_stages; }
+
+    // one decoding step of every sequence: tokens[i] at positions[i]
+    void step(const std::vector<int>& tokens, const std::vector<int>& positions) {
+        int n = sequences.size();
+        for (int i = 0 ; i < n ; i++) {
+            sequences[i]->token = tokens[i];
+            sequences[i]->pos = positions[i];
+        }
+
+        int batches = 0;
+        for (int first = 0 ; first < n ; first += batch_size) {
+            queues[0]->push(micro_batch{first, std::min(batch_size, n - first)});
+            batches++;
+        }
+
+        for (int b = 0 ; b < batches ; b++) {
+            queues[n_stages]->pop();
+        }
+    }
+
+    // logits of sequence i from the last step, valid until the next one
+    tensor& logits(int i) { return sequences[i]->logits; }
+};
+
+#endif
@@ -1,9 +1,16 @@
+#ifndef __llama2_sampler_h
+#define __llama2_sampler_h
+
 #include <vector>
 #include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
 
 #include "tensor.h"
 #include "mathlib.h"
+#include "trace.h"
+#include "memory.h"
 
 unsigned int random_u32(unsigned long long *state) {
     // xorshift rng: https://en.wikipedia.org/wiki/Xorshift#xorshift.2A
@@ -23,7 +30,8 @@ float random_f32(unsigned long long *state) { // random float32 in [0,1)
 
 class Sampler {
     int vocab_size;
-    std::vector<std::pair<float, int>> prob_index;  // buffer used in top-p sampling
+    typedef std::pair<float, int> prob_pair;
+    std::vector<prob_pair, memory::allocator<prob_pair, memory::category::sampler>> prob_index; // buffer used in top-p sampling
     float temperature;
     float topp;
     unsigned long long rng_state;
@@ -33,7 +41,7 @@ class Sampler {
     : vocab_size{vocab_size}, temperature{temperature}, topp{topp}, rng_state{rng_seed}
     {
         // buffer only used with nucleus sampling; may not need but it's ~small
-        prob_index = std::vector<std::pair<float, int>>(vocab_size);
+        prob_index.resize(vocab_size);
     }
 
     int sample_argmax(tensor probabilities) {
@@ -110,7 +118,13 @@ class Sampler {
         return prob_index[last_idx].second; // in case of rounding errors
     }
 
+    // the random state, to save and restore a session
+    unsigned long long get_rng_state() const { return rng_state; }
+    void set_rng_state(unsigned long long state) { rng_state = state; }
+
     int sample(tensor& logits) {
+        TRACE_SCOPE("sample");
+        memory::scope scratch{memory::category::sampler};
         // sample the token given the logits and some hyperparameters
         int next;
         if (temperature == 0.0f) {
@@ -136,4 +150,29 @@ class Sampler {
 
         return next;
     }
+
+    // sample among the tokens allowed by a constraint, bit t of allowed[t / 64] for
+    // token t: the others get no probability, the usual sampling runs on the rest
+    int sample(tensor& logits, const uint64_t* allowed) {
+        {
+            TRACE_SCOPE("mask");
+            float* data = logits.get_data();
+            for (int w = 0; w * 64 < vocab_size; w++) {
+                if (allowed[w] == ~0ull) {
+                    continue; // nothing masked in this word
+                }
+
+                const int end = std::min(64, vocab_size - w * 64);
+                for (int b = 0; b < end; b++) {
+                    if (!(allowed[w] >> b & 1)) {
+                        data[w * 64 + b] = -INFINITY;
+                    }
+                }
+            }
+        }
+
+        return sample(logits);
+    }
 };
+
+#endif
@@ -0,0 +1,391 @@
+#include "llama2.h"
+#include "encoder/bpe.h"
+#include "sampler.h"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// ----------------------------------------------------------------------------
+// A long-lived inference server: the model and tokenizer are loaded once, then
+// requests come in over a Unix domain socket, one JSON object per line:
+//
+//   {"id": "a", "prompt": "Once upon a time", "steps": 128, "temperature": 0.8, "topp": 0.9, "seed": 42}
+//   {"stats": true}
+//
+// Generation requests go through one queue to the thread owning the model, which
+// streams the tokens back as they are decoded and ends with the timings:
+//
+//   {"id": "a", "token": " there"}
+//   {"id": "a", "done": true, "tokens": 37, "queued_ms": 0.0, "first_token_ms": 12.1, "latency_ms": 240.5, "tok_s": 154.2}
+//
+// Stats are answered right away with the counters since start. The queue is the
+// one place where requests meet, batching them would go in its consumer.
+//
+//   server model.bin [socket path]
+
+typedef std::chrono::steady_clock clock_type;
+
+static double ms_since(clock_type::time_point start, clock_type::time_point end = clock_type::now()) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// ----------------------------------------------------------------------------
+// JSON lines: flat objects of strings, numbers and booleans are all we need
+
+static std::string json_escape(const std::string& text) {
+    std::string out;
+    for (unsigned char c : text) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+
+    return out;
+}
+
+// the fields of a flat object, strings unescaped and other values as written
+static bool parse_object(const std::string& line, std::map<std::string, std::string>& fields) {
+    size_t i = 0;
+    auto skip_space = [&] { while (i < line.size() && isspace((unsigned char)line[i])) { i++; } };
+    auto parse_string = [&](std::string& out) {
+        if (line[i] != '"') { return false; }
+        for (i++ ; i < line.size() && line[i] != '"' ; i++) {
+            if (line[i] != '\\') { out += line[i]; continue; }
+            if (++i == line.size()) { return false; }
+            switch (line[i]) {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    // code points of the basic plane, as utf-8
+                    if (i + 4 >= line.size()) { return false; }
+                    unsigned code = strtoul(line.substr(i + 1, 4).c_str(), nullptr, 16);
+                    i += 4;
+                    if (code < 0x80) {
+                        out += (char)code;
+                    } else if (code < 0x800) {
+                        out += (char)(0xc0 | (code >> 6));
+                        out += (char)(0x80 | (code & 0x3f));
+                    } else {
+                        out += (char)(0xe0 | (code >> 12));
+                        out += (char)(0x80 | ((code >> 6) & 0x3f));
+                        out += (char)(0x80 | (code & 0x3f));
+                    }
+                    break;
+                }
+                default: out += line[i]; // " \ /
+            }
+        }
+
+        if (i == line.size()) { return false; }
+        i++;
+        return true;
+    };
+
+    skip_space();
+    if (i == line.size() || line[i++] != '{') { return false; }
+    skip_space();
+    if (i < line.size() && line[i] == '}') { return true; }
+    while (i < line.size()) {
+        std::string key, value;
+        skip_space();
+        if (!parse_string(key)) { return false; }
+        skip_space();
+        if (i == line.size() || line[i++] != ':') { return false; }
+        skip_space();
+        if (i == line.size()) { return false; }
+        if (line[i] == '"') {
+            if (!parse_string(value)) { return false; }
+        } else {
+            while (i < line.size() && line[i] != ',' && line[i] != '}' && !isspace((unsigned char)line[i])) {
+                value += line[i++];
+            }
+        }
+
+        fields[key] = value;
+        skip_space();
+        if (i == line.size()) { return false; }
+        if (line[i] == '}') { return true; }
+        if (line[i++] != ',') { return false; }
+    }
+
+    return false;
+}
+
+// ----------------------------------------------------------------------------
+// the server state: connections, the request queue and the counters
+
+// a client; closed when the last request and reader holding it are done
+struct connection {
+    int fd;
+    std::mutex write_mutex; // lines of the worker and the reader must not interleave
+    bool open = true;
+
+    connection(int fd) : fd{fd} {}
+    ~connection() { close(fd); }
+
+    bool send_line(const std::string& line) {
+        std::lock_guard<std::mutex> lock{write_mutex};
+        std::string data = line + "\n";
+        for (size_t sent = 0 ; open && sent < data.size() ; ) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) { open = false; break; }
+            sent += n;
+        }
+
+        return open;
+    }
+};
+
+struct request {
+    std::string id;
+    std::string prompt;
+    int steps;
+    float temperature;
+    float topp;
+    unsigned long long seed;
+    std::shared_ptr<connection> client;
+    clock_type::time_point queued;
+};
+
+static std::mutex queue_mutex;
+static std::condition_variable queue_ready;
+static std::deque<request> queue;
+
+struct server_stats {
+    long requests = 0;        // done
+    long failed = 0;          // bad lines, or clients gone before the end
+    long tokens = 0;          // generated, prompts not included
+    double latency_ms = 0;    // sums over the requests done
+    double first_token_ms = 0;
+    long decode_tokens = 0;   // generated after the first, which comes with the prefill
+    double decode_ms = 0;     // their time
+};
+
+static std::mutex stats_mutex;
+static server_stats stats;
+static clock_type::time_point started;
+static std::string socket_path;
+
+static std::string stats_line() {
+    size_t queued;
+    {
+        std::lock_guard<std::mutex> lock{queue_mutex};
+        queued = queue.size();
+    }
+
+    std::lock_guard<std::mutex> lock{stats_mutex};
+    double done = std::max(stats.requests, 1L);
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "{\"uptime_s\": %.1f, \"requests\": %ld, \"failed\": %ld, \"queued\": %zu, \"tokens\": %ld, "
+             "\"mean_latency_ms\": %.1f, \"mean_first_token_ms\": %.1f, \"tok_s\": %.1f}",
+             ms_since(started) / 1000.0, stats.requests, stats.failed, queued, stats.tokens,
+             stats.latency_ms / done, stats.first_token_ms / done,
+             stats.decode_ms > 0 ? stats.decode_tokens / stats.decode_ms * 1000.0 : 0.0);
+    return buf;
+}
+
+// ----------------------------------------------------------------------------
+// the worker: the only thread touching the model, one request at a time
+
+static void generate(llama2& model, bpe& tokenizer, const request& req) {
+    clock_type::time_point start = clock_type::now();
+    Sampler sampler{model.config.vocab_size, req.temperature, req.topp, req.seed};
+    std::vector<int> prompt_tokens = tokenizer.encode(req.prompt, 1, 0);
+    const int num_prompt_tokens = prompt_tokens.size();
+    const int steps = std::min(req.steps, model.config.seq_len);
+    const std::string prefix = "{\"id\": \"" + json_escape(req.id) + "\", ";
+
+    // as in main: the prompt is forced, then the tokens are sampled until BOS or steps
+    clock_type::time_point first_token{};
+    int generated = 0;
+    bool client_open = true;
+    int token = prompt_tokens[0];
+    for (int pos = 0 ; pos < steps && client_open ; pos++) {
+        tensor logits = model.forward(token, pos);
+        int next = pos < num_prompt_tokens - 1 ? prompt_tokens[pos + 1] : sampler.sample(logits);
+        if (next == 1) { break; }
+
+        if (pos >= num_prompt_tokens - 1) {
+            if (generated++ == 0) { first_token = clock_type::now(); }
+            std::string piece = tokenizer.decode(token, next);
+            // raw byte tokens that are not printable or whitespace are dropped, like safe_printf
+            bool printable = piece.size() != 1 || isprint((unsigned char)piece[0]) || isspace((unsigned char)piece[0]);
+            if (printable && !piece.empty()) {
+                client_open = req.client->send_line(prefix + "\"token\": \"" + json_escape(piece) + "\"}");
+            }
+        }
+
+        token = next;
+    }
+
+    clock_type::time_point end = clock_type::now();
+    double latency = ms_since(req.queued, end);
+    double first = generated ? ms_since(req.queued, first_token) : latency;
+    double decode = generated ? ms_since(first_token, end) : 0.0;
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "\"done\": true, \"tokens\": %d, \"queued_ms\": %.1f, \"first_token_ms\": %.1f, \"latency_ms\": %.1f, \"tok_s\": %.1f}",
+             generated, ms_since(req.queued, start), first, latency, decode > 0 ? (generated - 1) / decode * 1000.0 : 0.0);
+    client_open = client_open && req.client->send_line(prefix + buf);
+
+    std::lock_guard<std::mutex> lock{stats_mutex};
+    if (!client_open) {
+        stats.failed++;
+        return;
+    }
+
+    stats.requests++;
+    stats.tokens += generated;
+    stats.latency_ms += latency;
+    stats.first_token_ms += first;
+    stats.decode_tokens += std::max(generated - 1, 0);
+    stats.decode_ms += decode;
+}
+
+static void worker(llama2* model, bpe* tokenizer) {
+    for (;;) {
+        request req;
+        {
+            std::unique_lock<std::mutex> lock{queue_mutex};
+            queue_ready.wait(lock, [] { return !queue.empty(); });
+            req = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        generate(*model, *tokenizer, req);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// a reader per connection: parse the lines, queue the requests, answer stats
+
+static void reader(std::shared_ptr<connection> client) {
+    static long next_id = 0;
+    static std::mutex id_mutex;
+    std::string pending;
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(client->fd, buf, sizeof(buf), 0)) > 0) {
+        pending.append(buf, n);
+        size_t end;
+        while ((end = pending.find('\n')) != std::string::npos) {
+            std::string line = pending.substr(0, end);
+            pending.erase(0, end + 1);
+            if (line.find_first_not_of(" \t\r") == std::string::npos) { continue; }
+
+            std::map<std::string, std::string> fields;
+            if (!parse_object(line, fields)) {
+                client->send_line("{\"error\": \"expected a JSON object per line\"}");
+                std::lock_guard<std::mutex> lock{stats_mutex};
+                stats.failed++;
+                continue;
+            }
+
+            if (fields.count("stats") && fields["stats"] != "false") {
+                client->send_line(stats_line());
+                continue;
+            }
+
+            request req;
+            if (fields.count("id")) {
+                req.id = fields["id"];
+            } else {
+                std::lock_guard<std::mutex> lock{id_mutex};
+                req.id = std::to_string(next_id++);
+            }
+
+            req.prompt = fields["prompt"];
+            req.steps = fields.count("steps") ? atoi(fields["steps"].c_str()) : 256;
+            req.temperature = fields.count("temperature") ? atof(fields["temperature"].c_str()) : 1.0f;
+            req.topp = fields.count("topp") ? atof(fields["topp"].c_str()) : 0.9f;
+            req.seed = fields.count("seed") ? strtoull(fields["seed"].c_str(), nullptr, 10) : (unsigned long long)time(NULL);
+            if (req.temperature < 0.0f) req.temperature = 0.0f;
+            if (req.topp < 0.0f || 1.0f < req.topp) req.topp = 0.9f;
+            if (req.steps < 0) req.steps = 0;
+            req.client = client;
+            req.queued = clock_type::now();
+            {
+                std::lock_guard<std::mutex> lock{queue_mutex};
+                queue.push_back(std::move(req));
+            }
+
+            queue_ready.notify_one();
+        }
+    }
+}
+
+static void on_signal(int) {
+    unlink(socket_path.c_str());
+    _exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <checkpoint> [socket path]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    socket_path = argc > 2 ? argv[2] : "tinyinference.sock";
+    llama2 model;
+    model.read_checkpoint(argv[1]);
+    model.fuse_projections();
+    bpe tokenizer("tokenizer.bin", model.config.vocab_size);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (listener == -1 || socket_path.size() >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Couldn't create the socket %s\n", socket_path.c_str());
+        return EXIT_FAILURE;
+    }
+
+    strcpy(address.sun_path, socket_path.c_str());
+    unlink(socket_path.c_str());
+    if (bind(listener, (sockaddr*)&address, sizeof(address)) == -1 || listen(listener, 16) == -1) {
+        fprintf(stderr, "Couldn't listen on %s\n", socket_path.c_str());
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    started = clock_type::now();
+    std::thread{worker, &model, &tokenizer}.detach();
+    fprintf(stderr, "listening on %s\n", socket_path.c_str());
+
+    for (;;) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd == -1) {
+            if (errno == EINTR) { continue; }
+            fprintf(stderr, "accept failed!\n");
+            return EXIT_FAILURE;
+        }
+
+        std::thread{reader, std::make_shared<connection>(fd)}.detach();
+    }
+}
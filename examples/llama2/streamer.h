@@ -0,0 +1,178 @@
+#ifndef __llama2_streamer_h
+#define __llama2_streamer_h
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// ----------------------------------------------------------------------------
+// Out-of-core layer streaming. When the checkpoint is larger than the memory we
+// are allowed to use, letting the kernel fault the mmap in at random thrashes the
+// page cache. The streamer knows the order in which llama2::forward visits the
+// layers: while layer L runs, a dedicated I/O thread pulls layer L+1 in, and the
+// layers that already ran are released once the resident budget is exceeded.
+
+class layer_streamer {
+    struct range {
+        char* ptr;
+        size_t bytes;
+    };
+
+    int fd = -1;                        // checkpoint file, used to drop page cache
+    char* base = nullptr;               // start of the checkpoint mapping
+    size_t page_size = 4096;
+    size_t budget = 0;                  // resident bytes allowed for layer weights
+    bool enabled = false;
+
+    std::vector<std::vector<range>> layers;  // weight ranges of every layer
+    std::vector<size_t> layer_bytes;
+    std::deque<int> resident;           // layers in the order they were brought in
+    size_t resident_bytes = 0;
+
+    // the I/O thread prefetches one layer at a time
+    std::thread io_thread;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::condition_variable prefetched; // in_flight went back to -1
+    std::deque<int> pending;
+    int in_flight = -1;                 // layer the I/O thread is touching
+    bool stopping = false;
+
+    void prefetch(int l) {
+        for (const range& r : layers[l]) {
+            // round outwards, pulling in a neighbour's partial page is harmless
+            char* start = base + ((r.ptr - base) / page_size) * page_size;
+            char* end = r.ptr + r.bytes;
+            madvise(start, end - start, MADV_WILLNEED);
+            // touch every page so the data is in memory before the compute thread needs it
+            volatile char sink = 0;
+            for (char* p = start; p < end; p += page_size) { sink += *p; }
+            (void)sink;
+        }
+    }
+
+    void release(int l) {
+        for (const range& r : layers[l]) {
+            // round inwards, so a neighbouring layer never loses its pages
+            size_t first = ((r.ptr - base) + page_size - 1) / page_size * page_size;
+            size_t last = ((r.ptr - base) + r.bytes) / page_size * page_size;
+            if (last <= first) { continue; }
+            madvise(base + first, last - first, MADV_DONTNEED);
+            // the mapping is private and read-only, so the page cache copy is clean and can go too
+            posix_fadvise(fd, first, last - first, POSIX_FADV_DONTNEED);
+        }
+    }
+
+    void io_loop() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            cv.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (stopping) { return; }
+            int l = pending.front();
+            pending.pop_front();
+            in_flight = l;
+            lock.unlock();
+            prefetch(l);
+            lock.lock();
+            in_flight = -1;
+            prefetched.notify_all();
+        }
+    }
+
+    bool is_resident(int l) const {
+        return std::find(resident.begin(), resident.end(), l) != resident.end();
+    }
+
+    void make_resident(int l) {
+        if (is_resident(l)) { return; }
+        resident.push_back(l);
+        resident_bytes += layer_bytes[l];
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            pending.push_back(l);
+        }
+        cv.notify_one();
+    }
+
+public:
+    layer_streamer() {}
+
+    ~layer_streamer() {
+        disable();
+    }
+
+    void init(int fd, void* base, int n_layers) {
+        this->fd = fd;
+        this->base = (char*)base;
+        page_size = sysconf(_SC_PAGESIZE);
+        layers.assign(n_layers, {});
+        layer_bytes.assign(n_layers, 0);
+    }
+
+    // register a weight range belonging to layer l
+    void add_range(int l, const void* ptr, size_t bytes) {
+        layers[l].push_back({(char*)ptr, bytes});
+        layer_bytes[l] += bytes;
+    }
+
+    // start streaming with the given resident budget in bytes. The layer that is
+    // running and the one being prefetched are always kept, so a budget of 0
+    // gives the smallest footprint: two layers.
+    void enable(size_t resident_budget) {
+        if (enabled) { disable(); }
+        budget = resident_budget;
+        stopping = false;
+        enabled = true;
+        io_thread = std::thread(&layer_streamer::io_loop, this);
+    }
+
+    void disable() {
+        if (!enabled) { return; }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+            pending.clear();
+        }
+        cv.notify_one();
+        io_thread.join();
+        resident.clear();
+        resident_bytes = 0;
+        enabled = false;
+    }
+
+    bool is_enabled() const { return enabled; }
+
+    // called by the forward pass right before layer l runs
+    void enter_layer(int l) {
+        if (!enabled) { return; }
+        int n_layers = layers.size();
+        int next = (l + 1) % n_layers; // after the last layer, the next token starts at layer 0
+
+        make_resident(l);
+        make_resident(next);
+
+        // drop the oldest layers until we fit the budget again
+        while (resident_bytes > budget && resident.size() > 2) {
+            int victim = resident.front();
+            if (victim == l || victim == next) { break; }
+            resident.pop_front();
+            resident_bytes -= layer_bytes[victim];
+            {
+                // a prefetch that has not started yet is no longer wanted, one that has
+                // would fault the pages back in behind release(): let it finish first
+                std::unique_lock<std::mutex> lock(mtx);
+                pending.erase(std::remove(pending.begin(), pending.end(), victim), pending.end());
+                prefetched.wait(lock, [&] { return in_flight != victim; });
+            }
+            release(victim);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef __llama2_token_stream_h
+#define __llama2_token_stream_h
+
+#include "encoder/bpe.h"
+#include "spsc_queue.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ----------------------------------------------------------------------------
+// Detokenization off the critical path. The decoding loop pushes every token it
+// samples and goes straight on to the next forward pass; a thread of the stream
+// turns the tokens into text, looks for the stop strings and hands the text to
+// the callback, which does the I/O. The tokens travel through a lock-free queue,
+// so the loop only waits when the callback falls a whole queue behind, and the
+// thread sleeps while the queue is empty rather than taking a core from the
+// forward pass.
+//
+// Text that could be the start of a stop string is held back until the next
+// token tells; a stop string ends the stream, and neither it nor anything after
+// it reaches the callback. The loop learns of it through stopped(), a few tokens
+// late at most. Pieces safe_printf would skip never reach the callback either,
+// so it can print the text as it is.
+
+class token_stream {
+public:
+    typedef std::function<void(const std::string&)> callback;
+
+private:
+    struct item {
+        int prev = 0;
+        int token = -1; // -1 tells the thread to stop
+    };
+
+    bpe& tokenizer;
+    callback on_text;
+    std::vector<std::string> stop_strings;
+    spsc_queue<item> queue;
+    std::atomic<bool> stop_seen{false};
+    std::string pending; // decoded, not passed on yet
+    std::thread worker;
+
+    // pass on what is decided: up to a stop string, or all but a possible start of one
+    void emit() {
+        size_t stop = std::string::npos;
+        for (const std::string& s : stop_strings) {
+            stop = std::min(stop, pending.find(s));
+        }
+
+        if (stop != std::string::npos) {
+            if (stop > 0) { on_text(pending.substr(0, stop)); }
+            pending.clear();
+            stop_seen.store(true, std::memory_order_release);
+            return;
+        }
+
+        size_t keep = 0;
+        for (const std::string& s : stop_strings) {
+            for (size_t k = std::min(s.size() - 1, pending.size()) ; k > keep ; k--) {
+                if (pending.compare(pending.size() - k, k, s, 0, k) == 0) {
+                    keep = k;
+                    break;
+                }
+            }
+        }
+
+        if (pending.size() > keep) {
+            on_text(pending.substr(0, pending.size() - keep));
+            pending.erase(0, pending.size() - keep);
+        }
+    }
+
+    void run() {
+        for (item it = queue.pop() ; it.token >= 0 ; it = queue.pop()) {
+            if (stop_seen.load(std::memory_order_relaxed)) { continue; }
+            TRACE_SCOPE("decode");
+            std::string piece = tokenizer.decode(it.prev, it.token);
+            // control bytes are dropped before they can be merged with the text around them
+            if (!bpe::printable(piece)) { continue; }
+            pending += piece;
+            emit();
+        }
+
+        if (!stop_seen.load(std::memory_order_relaxed) && !pending.empty()) {
+            on_text(pending);
+        }
+    }
+
+public:
+    token_stream(bpe& tokenizer, callback on_text, std::vector<std::string> stop_strings = {}, size_t capacity = 256)
+    : tokenizer{tokenizer}, on_text{on_text}, stop_strings{stop_strings}, queue{capacity} {
+        for (size_t i = 0 ; i < this->stop_strings.size() ; ) {
+            if (this->stop_strings[i].empty()) { this->stop_strings.erase(this->stop_strings.begin() + i); }
+            else { i++; }
+        }
+
+        worker = std::thread{[this] { run(); }};
+    }
+
+    token_stream(const token_stream&) = delete;
+    token_stream& operator=(const token_stream&) = delete;
+
+    ~token_stream() { finish(); }
+
+    // token follows prev in the output
+    void push(int prev, int token) { queue.push(item{prev, token}); }
+
+    // a stop string came out, the tokens pushed from now on are dropped
+    bool stopped() const { return stop_seen.load(std::memory_order_acquire); }
+
+    // wait until all the tokens pushed went through the callback
+    void finish() {
+        if (!worker.joinable()) { return; }
+        queue.push(item{});
+        worker.join();
+    }
+};
+
+#endif
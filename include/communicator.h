@@ -0,0 +1,52 @@
+#ifndef __tinyinference_communicator_h
+#define __tinyinference_communicator_h
+
+#include <cstddef>
+#include <string>
+
+// Collectives between the processes of a tensor parallel group on one host,
+// through a POSIX shared memory segment. Every rank must call the same
+// collectives in the same order; each one ends with every rank holding the same
+// result, reduced in rank order so the floats agree bit for bit.
+//
+// Rank 0 creates the segment, the others attach to it by name, either as
+// separately started processes or as forked children:
+//
+//   shm_communicator comm{"/model", n_ranks, max_floats};
+//   for (int r = 1 ; r < n_ranks ; r++) {
+//       if (fork() == 0) { comm.set_rank(r); break; }
+//   }
+
+class shm_communicator {
+    struct header;
+
+    std::string name;
+    header* shared = nullptr;
+    size_t mapped_bytes = 0;
+    int m_rank = 0;
+    bool owner = false;   // unlinks the segment when done
+    unsigned phase = 0;   // collectives so far, picks one of the two buffers
+
+    float* slot(unsigned buffer, int rank) const;
+
+    public:
+        // create the segment for n_ranks ranks exchanging up to max_floats floats each, as rank 0
+        shm_communicator(const char* name, int n_ranks, size_t max_floats);
+        // attach to the segment created by rank 0, waiting for it to appear
+        shm_communicator(const char* name, int rank);
+        ~shm_communicator();
+        shm_communicator(const shm_communicator&) = delete;
+        shm_communicator& operator=(const shm_communicator&) = delete;
+
+        void set_rank(int rank); // in a forked child
+        int rank() const { return m_rank; }
+        int size() const;
+
+        void barrier();
+        // data[n] = the sum of data[n] over all ranks
+        void all_reduce(float* data, size_t n);
+        // every rank contributes local[n] at offset in out[total]; all of out ends up on every rank
+        void all_gather(const float* local, size_t offset, size_t n, float* out, size_t total);
+};
+
+#endif
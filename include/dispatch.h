@@ -0,0 +1,88 @@
+#ifndef __tinyinference_dispatch_h
+#define __tinyinference_dispatch_h
+
+#include <cstdint>
+
+// instruction set levels we build kernels for, in increasing order
+enum class isa : int {
+    generic = 0,
+    avx2 = 1,   // AVX2 + FMA + F16C
+    avx512 = 2  // AVX-512 F/BW/VL on top of avx2
+};
+
+// what cpuid (and the OS, via xgetbv) tells us about the host
+struct cpu_features {
+    bool avx2 = false;
+    bool fma = false;
+    bool f16c = false;
+    bool avx512f = false;
+    bool avx512bw = false;
+    bool avx512vl = false;
+    bool avx512_vnni = false;
+    bool avx512_bf16 = false;
+};
+
+// kernels specialized on the head size / model dim, see rope_for and friends below
+typedef void (*rope_fn)(float* q, float* k, int dim, int kv_dim, int head_size, int pos);
+typedef void (*attend_fn)(float* out, const float* q, const float* key_cache, const float* value_cache,
+                          int kv_dim, float* att, int n_pos, int head_size);
+typedef void (*attend_paged_fn)(float* out, const float* q, const float* const* key_blocks, const float* const* value_blocks,
+                                int block_size, int kv_dim, float* att, int n_pos, int head_size);
+typedef void (*rms_norm_fn)(float* out, const float* x, const float* weight, int n, float eps);
+
+// The hot loops of the library, one table per instruction set level. Every
+// entry point in tensor/mathlib (and the attention of the examples) goes through
+// the table returned by kernels(), so one binary runs its fastest path everywhere.
+struct kernel_table {
+    const char* name;
+    isa level;
+
+    // out[m x n] = x[m x k] * w[n x k]^T, w in fp32 / f16 / bf16, accumulated in fp32.
+    // Each row of w is used for all m rows of x before the next, so it is read once
+    void (*matmul_f32)(float* out, const float* x, const float* w, int m, int n, int k);
+    void (*matmul_f16)(float* out, const float* x, const uint16_t* w, int m, int n, int k);
+    void (*matmul_bf16)(float* out, const float* x, const uint16_t* w, int m, int n, int k);
+
+    // out[m x n] = silu(x * w1^T) * (x * w3^T) with w = [w1; w3] stacked in one [2n x k]
+    // matrix, each pair of rows reduced and activated together
+    void (*swiglu_f32)(float* out, const float* x, const float* w, int m, int n, int k);
+    void (*swiglu_f16)(float* out, const float* x, const uint16_t* w, int m, int n, int k);
+    void (*swiglu_bf16)(float* out, const float* x, const uint16_t* w, int m, int n, int k);
+
+    // out[n] = sum of x[i] * wt[i] over the count rows i listed in index, wt = w^T in
+    // [k x n]: the matmul of a sparse x, reading only the weights its nonzeros need
+    void (*sparse_matmul_f32)(float* out, const float* x, const float* wt, const int* index, int count, int n);
+    void (*sparse_matmul_f16)(float* out, const float* x, const uint16_t* wt, const int* index, int count, int n);
+    void (*sparse_matmul_bf16)(float* out, const float* x, const uint16_t* wt, const int* index, int count, int n);
+
+    float (*dot)(const float* a, const float* b, int n);
+    float (*sum_squares)(const float* x, int n);
+    void (*axpy)(float* y, float a, const float* x, int n); // y += a * x
+
+    // Return the kernel compiled for the given size (head sizes 48, 64, 128 and
+    // dims 288, 512, 768, 4096), or the generic one for any other size. Callers
+    // select once, e.g. from the model Config, and keep the pointer.
+    //
+    // rope rotates q (dim) and k (kv_dim) in place for position pos.
+    // attend computes one head: scores of q against n_pos cached keys (rows kv_dim
+    // apart), softmax into att, and the weighted sum of the cached values into out.
+    // attend_paged does the same over a cache in blocks: position t is row
+    // t % block_size of block t / block_size.
+    rope_fn (*rope_for)(int head_size);
+    attend_fn (*attend_for)(int head_size);
+    attend_paged_fn (*attend_paged_for)(int head_size);
+    rms_norm_fn (*rms_norm_for)(int dim);
+};
+
+const cpu_features& host_features();
+isa host_isa(); // the best level supported by the host
+
+// The table is picked on first use: the best level the host supports, unless the
+// environment variable TINYINFERENCE_ISA (generic, avx2, avx512) asks for a lower one.
+const kernel_table& kernels();
+
+// force a level, mostly for testing and benchmarking. Levels the host or the
+// build does not support are clamped to the best available one.
+void set_kernels(isa level);
+
+#endif
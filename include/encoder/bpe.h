@@ -17,6 +17,10 @@ class bpe : public encoder {
         std::vector<int> encode(std::string text, bool bos, bool eos);
         std::string decode(int prev_token, int token);
         void safe_printf(std::string text);
+        // false for the pieces safe_printf skips: empty, or a single byte that is neither printable nor whitespace
+        static bool printable(const std::string& text);
+        // the bytes token stands for: its piece, or the raw byte of the <0xXX> tokens
+        std::string text(int token) const;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,208 @@
+#ifndef __tinyinference_expression_h
+#define __tinyinference_expression_h
+
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "tensor.h"
+
+// Lazy elementwise arithmetic. tensor + tensor, tensor * scalar, silu(x) and so
+// on build small expression nodes instead of tensors; the whole expression is
+// evaluated in one loop when it is assigned to a tensor, without temporaries:
+//
+//   hb = silu(hb) * hb2;  // one pass over hb and hb2, written into hb
+//
+// tensor * tensor is the one ambiguous operator: it is the elementwise product
+// when the shapes match and the matrix product x * w^T otherwise. The matrix
+// product is computed when the expression gets evaluated, straight into the
+// destination when it is the whole expression.
+//
+// Nodes reference their tensors, so evaluate them in the statement that builds
+// them; don't keep them around in auto variables.
+
+namespace expression {
+
+// a fp32 tensor, read in place
+struct leaf {
+    const float* data;
+    std::pair<int, int> dim;
+
+    leaf(const tensor& t) : data{t.get_data()}, dim{t.shape()} {
+        assert(t.type() == dtype::f32);
+    }
+
+    void prepare() const {}
+    float at(size_t i) const { return data[i]; }
+    std::pair<int, int> shape() const { return dim; }
+};
+
+// a float broadcast to the shape of the other operand
+struct scalar {
+    float val;
+
+    void prepare() const {}
+    float at(size_t) const { return val; }
+    std::pair<int, int> shape() const { return {0, 0}; }
+};
+
+template <typename A, typename B, typename OP>
+struct binary {
+    A a;
+    B b;
+
+    binary(const A& a, const B& b) : a{a}, b{b} {
+        assert(a.shape().first == 0 || b.shape().first == 0 || a.shape() == b.shape());
+    }
+
+    void prepare() const { a.prepare(); b.prepare(); }
+    float at(size_t i) const { return OP::apply(a.at(i), b.at(i)); }
+    std::pair<int, int> shape() const { return a.shape().first ? a.shape() : b.shape(); }
+};
+
+template <typename A, typename OP>
+struct unary {
+    A a;
+
+    void prepare() const { a.prepare(); }
+    float at(size_t i) const { return OP::apply(a.at(i)); }
+    std::pair<int, int> shape() const { return a.shape(); }
+};
+
+struct add_op { static float apply(float a, float b) { return a + b; } };
+struct sub_op { static float apply(float a, float b) { return a - b; } };
+struct mul_op { static float apply(float a, float b) { return a * b; } };
+struct sigmoid_op { static float apply(float x) { return 1.0f / (1.0f + expf(-x)); } };
+struct silu_op { static float apply(float x) { return x * (1.0f / (1.0f + expf(-x))); } };
+
+// tensor * tensor: elementwise if the shapes match, else out[m x n] = x[m x k] * w[n x k]^T
+class product {
+    friend void evaluate(float* out, const product& p);
+
+    const tensor* x;
+    const tensor* w;
+    mutable tensor result; // the matrix product, once computed for use inside a bigger expression
+    mutable const float* values = nullptr;
+
+    public:
+        product(const tensor& x, const tensor& w) : x{&x}, w{&w} {
+            if (!is_matmul()) {
+                assert(x.type() == dtype::f32 && w.type() == dtype::f32);
+            } else if (x.columns() != w.columns()) {
+                throw std::runtime_error("Matrix dimensions are not compatible.");
+            }
+        }
+
+        product(const product& p) : x{p.x}, w{p.w} {}
+
+        bool is_matmul() const { return x->shape() != w->shape(); }
+
+        std::pair<int, int> shape() const {
+            return is_matmul() ? std::pair<int, int>{(int)x->rows(), (int)w->rows()} : x->shape();
+        }
+
+        // out must hold shape() floats and must not overlap x
+        void matmul_into(float* out) const;
+
+        void prepare() const {
+            if (is_matmul() && values == nullptr) {
+                result = tensor{shape()};
+                matmul_into(result.get_data());
+                values = result.get_data();
+            }
+        }
+
+        float at(size_t i) const {
+            return values ? values[i] : x->get_data()[i] * w->get_data()[i];
+        }
+};
+
+template <typename T>
+struct is_node : std::false_type {};
+template <> struct is_node<leaf> : std::true_type {};
+template <> struct is_node<scalar> : std::true_type {};
+template <> struct is_node<product> : std::true_type {};
+template <typename A, typename B, typename OP> struct is_node<binary<A, B, OP>> : std::true_type {};
+template <typename A, typename OP> struct is_node<unary<A, OP>> : std::true_type {};
+
+template <typename T>
+using is_tensor = std::is_base_of<tensor, T>;
+
+template <typename T>
+using is_operand = std::integral_constant<bool, is_node<T>::value || is_tensor<T>::value || std::is_arithmetic<T>::value>;
+
+// operands as nodes: tensors become leaves, numbers scalars
+inline leaf node(const tensor& t) { return leaf{t}; }
+template <typename T, typename std::enable_if<std::is_arithmetic<T>::value, int>::type = 0>
+inline scalar node(T val) { return scalar{(float)val}; }
+template <typename E, typename std::enable_if<is_node<E>::value, int>::type = 0>
+inline const E& node(const E& e) { return e; }
+
+template <typename T>
+using node_t = typename std::decay<decltype(node(std::declval<const T&>()))>::type;
+
+// a binary operator that takes part in expressions: at least one node or tensor
+template <typename A, typename B>
+using enable_binary = typename std::enable_if<is_operand<A>::value && is_operand<B>::value &&
+    (is_node<A>::value || is_node<B>::value || is_tensor<A>::value || is_tensor<B>::value), int>::type;
+
+template <typename E>
+void evaluate(float* out, const E& e) {
+    e.prepare();
+    const std::pair<int, int> dim = e.shape();
+    const size_t n = (size_t)dim.first * dim.second;
+    for (size_t i = 0 ; i < n ; i++) {
+        out[i] = e.at(i);
+    }
+}
+
+// a matrix product on its own is written straight into the destination
+void evaluate(float* out, const product& p);
+
+}
+
+template <typename A, typename B, expression::enable_binary<A, B> = 0>
+inline expression::binary<expression::node_t<A>, expression::node_t<B>, expression::add_op> operator+(const A& a, const B& b) {
+    return {expression::node(a), expression::node(b)};
+}
+
+template <typename A, typename B, expression::enable_binary<A, B> = 0>
+inline expression::binary<expression::node_t<A>, expression::node_t<B>, expression::sub_op> operator-(const A& a, const B& b) {
+    return {expression::node(a), expression::node(b)};
+}
+
+// two tensors go to the product below instead
+template <typename A, typename B, expression::enable_binary<A, B> = 0,
+          typename std::enable_if<!(expression::is_tensor<A>::value && expression::is_tensor<B>::value), int>::type = 0>
+inline expression::binary<expression::node_t<A>, expression::node_t<B>, expression::mul_op> operator*(const A& a, const B& b) {
+    return {expression::node(a), expression::node(b)};
+}
+
+inline expression::product operator*(const tensor& x, const tensor& w) {
+    return expression::product{x, w};
+}
+
+template <typename E, typename>
+tensor::tensor(const E& e) : ref{true}, m_data{nullptr}, dim{e.shape()} {
+    allocate();
+    expression::evaluate(m_data, e);
+}
+
+template <typename E, typename>
+tensor& tensor::operator=(const E& e) {
+    const std::pair<int, int> shape = e.shape();
+    if (m_type == dtype::f32 && m_data != nullptr && size() == (size_t)shape.first * shape.second) {
+        // same size: evaluate in place, elementwise nodes only read the index they write
+        dim = shape;
+        expression::evaluate(m_data, e);
+    } else {
+        // the expression may read the storage we are about to replace
+        *this = tensor{e};
+    }
+
+    return *this;
+}
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef __tinyinference_graph_h
+#define __tinyinference_graph_h
+
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+#include "tensor.h"
+#include "dispatch.h"
+#include "paged_kv_cache.h"
+
+class shm_communicator;
+class lora_bank;
+
+// A model forward pass declared as a DAG of ops on row vectors, compiled once
+// and then run for every token without allocating:
+//
+//   graph g;
+//   graph::value x = g.embedding(table);
+//   x = g.add(x, g.linear(g.rms_norm(x, norm), w));
+//   g.output(g.linear(x, wcls));
+//   g.compile();
+//   tensor logits = g.run(token, pos);
+//
+// compile() fuses silu followed by mul into one pass, lets elementwise ops,
+// rms_norm and rope write over an input that dies with them, and plans every
+// intermediate into one workspace: values whose lifetimes do not overlap share
+// memory. Ops are appended in execution order, every op only reads values
+// declared before it.
+//
+// compile(batch) makes room for up to batch rows, one per sequence: run() then
+// takes a token, position and sequence for each row, the matmuls read every
+// weight once for all of them. Sequences other than the first need their own kv
+// cache, which is what the paged attention is for.
+//
+// The graph keeps pointers to the weight and cache tensors it is given, they
+// must outlive it.
+
+class graph {
+    public:
+        typedef int value; // an op output, -1 for ops without one
+
+        // sources
+        value input(const tensor& x);            // copied from x on every run, a row of x per row
+        value embedding(const tensor& table);    // the row of the token passed to run(), any dtype
+
+        value rms_norm(value x, const tensor& weight, float eps = 1e-5f);
+        value linear(value x, const tensor& weight, const char* name = "linear");  // x * weight^T, any dtype
+        value swiglu(value x, const tensor& w13, const char* name = "swiglu");     // see swiglu() in mathlib
+        // x * weight^T over only some entries of x: those with |x| > threshold, or the top_k
+        // largest |x| if top_k > 0. wt is weight transposed ([x size x output size]) so the
+        // rows of the entries kept are contiguous, any dtype
+        value sparse_linear(value x, const tensor& wt, float threshold, int top_k = 0, const char* name = "sparse_linear");
+        value slice(value x, int offset, int size); // view of x[offset, offset + size), no copy
+        value rope(value x, int head_size);         // rotate every head of x for the position of the step
+        // causal self attention for the position of the step; k and v are stored in row
+        // pos of the caches ([seq_len x kv_dim]) first, n_heads / n_kv_heads query heads
+        // share a key/value head.
+        // With sinks >= 0 the caches are a sliding window instead, for positions past
+        // their end: the first sinks tokens stay, the other rows are a ring of the most
+        // recent ones. k must be rotated for pos; once tokens were dropped the sinks are
+        // rotated again every step, so each key sits at its slot distance from the query.
+        // sink_keys ([sinks x kv_dim]) keeps them as they were stored: it belongs with
+        // the caches and outlives the graph like them.
+        value attention(value q, value k, value v, tensor& key_cache, tensor& value_cache, int n_heads, int n_kv_heads,
+                        int sinks = -1, tensor* sink_keys = nullptr);
+        // the same on layer of a paged cache, at the position of each row in its sequence
+        value attention(value q, value k, value v, paged_kv_cache& cache, int layer, int n_heads, int n_kv_heads);
+        // y with the low-rank delta of slot added to y[offset, offset + out): scale * B * (A * x)
+        // of the adapter of the row in bank, where it has one (see lora.h)
+        value lora(value y, value x, const lora_bank& bank, int slot, int offset = 0, const char* name = "lora");
+        value silu(value x);
+        value mul(value a, value b);
+        value add(value a, value b);
+        // collectives of a tensor parallel group, every rank's graph must have the same ones
+        value all_reduce(value x, shm_communicator& comm);                        // sum of x over the ranks
+        value all_gather(value x, shm_communicator& comm, int offset, int size); // x at offset of every rank's [size]
+
+        void hook(std::function<void()> fn); // called when execution gets there, e.g. to prefetch weights
+        void set_layer(int layer);           // layer tag of the following ops in traces
+        void output(value x);
+
+        void compile(int batch = 1);
+        // run the graph for one token at position pos, with the lora ops of adapter (-1 for
+        // none); a view of the output, valid until the next run
+        tensor run(int token, int pos, int adapter = -1);
+        // run rows at once: tokens[r] at positions[r] of sequences[r] (r by default) in
+        // the paged caches, with adapters[r] (none by default); a view of the [rows x size]
+        // output, valid until the next run
+        tensor run(const std::vector<int>& tokens, const std::vector<int>& positions,
+                   const std::vector<int>& sequences = {}, const std::vector<int>& adapters = {});
+        tensor result();                     // the same view, after compile()
+
+        size_t workspace_bytes() const;      // after compile()
+        size_t unplanned_bytes() const;      // what every op allocating its own output would take
+        void print_plan(FILE* out) const;
+        // fraction of the sparse_linear inputs kept, over the runs since compile()
+        double sparse_density() const;
+
+    private:
+        enum class op { input, embedding, rms_norm, linear, swiglu, slice, rope, attention, silu, mul, add, silu_mul, sparse_linear, all_reduce, all_gather, lora, hook };
+
+        struct node {
+            op type;
+            const char* name;
+            int layer = -1;                      // set by append()
+            value a = -1, b = -1, c = -1;
+            int size = 0;                        // floats in the output
+            const tensor* weight = nullptr;
+            tensor* key_cache = nullptr;
+            tensor* value_cache = nullptr;
+            paged_kv_cache* pages = nullptr;
+            int cache_layer = 0;
+            int offset = 0;                      // slice, all_gather, lora
+            int head_size = 0;
+            int n_heads = 0;
+            int n_kv_heads = 0;
+            int sinks = -1;                      // attention as a sliding window
+            tensor* sink_keys = nullptr;         // as they were stored, [sinks x kv_dim]
+            float eps = 0.0f;
+            float threshold = 0.0f;              // sparse_linear
+            int top_k = 0;
+            std::function<void()> fn;
+            shm_communicator* comm = nullptr;
+            const lora_bank* bank = nullptr;
+            int slot = 0;                        // of the lora pair in bank
+            rms_norm_fn norm = nullptr;
+            rope_fn rotate = nullptr;
+            attend_fn attend = nullptr;
+            attend_paged_fn attend_paged = nullptr;
+
+            // filled by compile()
+            bool skip = false;                   // fused into a later op
+            value root = -1;                     // value owning the storage this one lives in
+            size_t base = 0;                     // offset of this value inside root's storage
+            int last_use = -1;
+            size_t position = 0;                 // offset of a root in the workspace
+
+            node(op type, const char* name) : type{type}, name{name} {}
+        };
+
+        std::vector<node> nodes;
+        value out = -1;
+        int current_layer = -1;
+        bool compiled = false;
+        tensor workspace;
+        tensor att; // attention scores scratch, as long as the longest cache
+        std::vector<const float*> blocks; // of every kv head, for the paged attention
+        std::vector<int> selected; // entries kept by a sparse_linear
+        size_t sparse_inputs = 0;
+        size_t sparse_kept = 0;
+        std::vector<float> low_rank; // A * x of a lora op
+        int batch = 1;
+        int rows = 1;                        // of the current run
+        std::vector<int> tokens{0};
+        std::vector<int> positions{0};
+        std::vector<int> sequences{0};
+        std::vector<int> adapters{-1};
+
+        value append(node n);
+        const node& at(value v) const;
+        float* data(value v, int row = 0);
+        int stride(value v) const;           // floats between the rows of v
+        bool overlaps(value u, value v) const;
+        void fuse();
+        void plan();
+        void execute(node& n);
+        void execute(node& n, int row);
+        void matmul(const node& n, float* y, const float* x, int m);
+        void attend(node& n, float* y, int pos);
+        void attend_paged(node& n, float* y, int row);
+        tensor step();
+};
+
+#endif
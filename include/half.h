@@ -0,0 +1,130 @@
+#ifndef __tinyinference_half_h
+#define __tinyinference_half_h
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// storage type of the elements of a tensor. Arithmetic always happens in fp32,
+// the half precision types only exist to halve the memory traffic of weights.
+enum class dtype : int {
+    f32 = 0,
+    f16 = 1,
+    bf16 = 2
+};
+
+static inline size_t dtype_size(dtype type) {
+    return type == dtype::f32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+static inline float bits_to_fp32(uint32_t bits) {
+    float f;
+    memcpy(&f, &bits, sizeof(float));
+    return f;
+}
+
+static inline uint32_t fp32_to_bits(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(float));
+    return bits;
+}
+
+static inline float fp16_to_fp32(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+
+    if (exp == 0x1f) {
+        // inf / nan
+        return bits_to_fp32(sign | 0x7f800000 | (mant << 13));
+    }
+
+    if (exp == 0) {
+        if (mant == 0) {
+            return bits_to_fp32(sign);
+        }
+
+        // subnormal: renormalize the mantissa
+        exp = 127 - 15 + 1;
+        while ((mant & 0x400) == 0) {
+            mant <<= 1;
+            exp--;
+        }
+
+        return bits_to_fp32(sign | (exp << 23) | ((mant & 0x3ff) << 13));
+    }
+
+    return bits_to_fp32(sign | ((exp + 127 - 15) << 23) | (mant << 13));
+}
+
+static inline uint16_t fp32_to_fp16(float f) {
+    uint32_t bits = fp32_to_bits(f);
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs = bits & 0x7fffffff;
+
+    if (abs >= 0x7f800000) {
+        // inf stays inf, nan stays a (quiet) nan
+        return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+    }
+
+    if (abs >= 0x477ff000) {
+        // rounds to something larger than the biggest half
+        return sign | 0x7c00;
+    }
+
+    if (abs < 0x38800000) {
+        // subnormal half (or zero): shift the mantissa into place, round to nearest even
+        if (abs < 0x33000000) {
+            return sign;
+        }
+
+        uint32_t exp = abs >> 23;
+        uint32_t mant = (abs & 0x7fffff) | 0x800000;
+        uint32_t shift = 126 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rest = mant & ((1u << shift) - 1);
+        uint32_t mid = 1u << (shift - 1);
+        if (rest > mid || (rest == mid && (half & 1))) {
+            half++;
+        }
+
+        return sign | half;
+    }
+
+    // normal half: rebias the exponent and round the mantissa to nearest even
+    uint32_t half = (abs - ((127 - 15) << 23)) >> 13;
+    uint32_t rest = abs & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+        half++;
+    }
+
+    return sign | half;
+}
+
+static inline float bf16_to_fp32(uint16_t h) {
+    return bits_to_fp32((uint32_t)h << 16);
+}
+
+static inline uint16_t fp32_to_bf16(float f) {
+    uint32_t bits = fp32_to_bits(f);
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        // keep nans quiet instead of rounding them into inf
+        return (bits >> 16) | 0x40;
+    }
+
+    // round to nearest even
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return bits >> 16;
+}
+
+// convert n elements between fp32 and a half precision type
+void to_fp32(float* out, const uint16_t* in, size_t n, dtype type);
+void from_fp32(uint16_t* out, const float* in, size_t n, dtype type);
+
+// out[m x n] = x[m x k] * w[n x k]^T, with w stored in half precision.
+// The weights are widened to fp32 in registers and accumulated in fp32,
+// by the kernels picked in dispatch.h.
+void matmul_f16(float* out, const float* x, const uint16_t* w, int m, int n, int k);
+void matmul_bf16(float* out, const float* x, const uint16_t* w, int m, int n, int k);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef __tinyinference_lora_h
+#define __tinyinference_lora_h
+
+#include <vector>
+
+#include "tensor.h"
+
+// Low-rank adapters (LoRA) over shared weights. An adapter turns the linear op
+// y = x * W^T of a slot into y = x * W^T + scale * (x * A^T) * B^T without
+// touching W, so any number of fine-tunes of one checkpoint share its weights
+// and only cost their own A [rank x in] and B [out x rank]. The model numbers
+// the slots (e.g. one per projection of every layer); graph::lora() applies the
+// pair of the adapter picked for each row, if it has one for that slot.
+//
+// Adapters can be added and released between runs of the graphs using the bank.
+// Ranks are capped at max_supported_rank, which graphs size their scratch for
+// when they are compiled, so adapters loaded later never make a run allocate.
+
+class lora_bank {
+    public:
+        struct pair {
+            tensor a;    // [rank x in], fp32
+            tensor b;    // [out x rank], fp32
+            float scale; // alpha / rank, usually
+        };
+
+        static const int max_supported_rank = 1024;
+
+        int create();                // a new adapter with no slots, its id
+        void release(int adapter);   // the id may be handed out again
+        void set(int adapter, int slot, tensor a, tensor b, float scale);
+        const pair* find(int adapter, int slot) const; // nullptr when not adapted, or for adapter -1
+
+        int size() const;            // adapters held
+        int max_rank() const;
+
+    private:
+        std::vector<std::vector<pair>> adapters; // by id then slot, empty pairs where not adapted
+        std::vector<bool> live;
+};
+
+#endif
@@ -5,7 +5,20 @@
 
 tensor rms_norm(const tensor& x, const tensor& weight, const float eps = 1e-5f);
 tensor softmax(const tensor& x);
-tensor sigmoid(const tensor& x);
-tensor silu(const tensor& x);
+
+// SwiGLU feed forward input: silu(x * w1^T) * (x * w3^T), with w the [2n x k]
+// stack of w1 and w3 in any dtype. One pass over the weights, no gate/up temporaries.
+tensor swiglu(const tensor& x, const tensor& w);
+
+// elementwise, lazy like the tensor arithmetic: silu(hb) * hb2 is a single pass
+template <typename A>
+inline expression::unary<expression::node_t<A>, expression::sigmoid_op> sigmoid(const A& x) {
+    return {expression::node(x)};
+}
+
+template <typename A>
+inline expression::unary<expression::node_t<A>, expression::silu_op> silu(const A& x) {
+    return {expression::node(x)};
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,87 @@
+#ifndef __tinyinference_memory_h
+#define __tinyinference_memory_h
+
+#include <cstddef>
+#include <cstdio>
+
+// Accounting of the memory held by tensors, caches and buffers, per category.
+// Every owned tensor allocation reports to it; memory that is not allocated
+// here (the mmap'd checkpoint) can be registered as external. Counters are
+// relaxed atomics, cheap enough to stay on in release builds.
+//
+// New tensors are charged to the category of the innermost scope on the
+// calling thread, activations when there is none:
+//
+//   {
+//       memory::scope kv{memory::category::kv_cache};
+//       key_cache = tensor{{config.seq_len, kv_dim}};
+//   }
+
+namespace memory {
+
+enum class category : int {
+    weights = 0,
+    kv_cache,
+    activations,
+    sampler,
+    other,
+    count
+};
+
+struct stats {
+    size_t live_bytes;  // held right now
+    size_t peak_bytes;  // highest live_bytes since start or the last reset_peak()
+    size_t allocations; // number of allocations so far
+};
+
+const char* name(category c);
+
+// the hook: called for every allocation and release that should be accounted
+void on_allocate(category c, size_t bytes);
+void on_release(category c, size_t bytes);
+
+stats get(category c);
+stats total(); // peak of the sum, not the sum of the peaks
+
+void reset_peak();
+void print_report(FILE* out);
+
+// category charged for allocations on this thread
+category current();
+
+class scope {
+    category previous;
+
+    public:
+        scope(category c);
+        ~scope();
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+};
+
+// std allocator that charges its allocations to a fixed category
+template <typename T, category C>
+struct allocator {
+    typedef T value_type;
+
+    allocator() = default;
+    template <typename U> allocator(const allocator<U, C>&) {}
+    template <typename U> struct rebind { typedef allocator<U, C> other; };
+
+    T* allocate(size_t n) {
+        on_allocate(C, n * sizeof(T));
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        on_release(C, n * sizeof(T));
+        ::operator delete(p);
+    }
+
+    template <typename U> bool operator==(const allocator<U, C>&) const { return true; }
+    template <typename U> bool operator!=(const allocator<U, C>&) const { return false; }
+};
+
+}
+
+#endif
@@ -7,12 +7,13 @@ class embedding : public tensor {
     public:
         embedding ();
         embedding (float* data, int vocab_size, int embd_dim);
+        embedding (void* data, int vocab_size, int embd_dim, dtype type);
         embedding (int vocab_size, int embd_dim);
         
         int embedding_size() const;
         int vocab_size() const;
 
-        tensor& operator() (size_t token) const;
+        tensor operator() (size_t token) const;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,56 @@
+#ifndef __tinyinference_paged_kv_cache_h
+#define __tinyinference_paged_kv_cache_h
+
+#include <vector>
+
+#include "tensor.h"
+
+// A kv cache for many sequences at once, in blocks of block_size positions
+// taken from one pool. A sequence is a table of blocks. fork() copies only the
+// table, so the new sequence shares every block with its parent; a shared block
+// is copied when either of them writes into it (copy on write). Sampling n
+// completions of a prompt thus holds the prompt once, plus a block or so per
+// branch for where they diverge.
+//
+// Blocks hold their positions of every layer, rows of kv_dim floats. They are
+// allocated the first time they are needed and reused once released, up to
+// n_blocks of them.
+
+class paged_kv_cache {
+    int n_layers;
+    int kv_dim;
+    int block_size;
+    std::vector<tensor> keys;              // [n_layers * block_size x kv_dim] per block
+    std::vector<tensor> values;
+    std::vector<int> refs;                 // sequences using each block
+    std::vector<int> free_blocks;
+    std::vector<std::vector<int>> tables;  // blocks of each sequence
+    std::vector<bool> live;
+
+    int allocate_block();
+    void check(int seq) const;
+    float* row(const std::vector<tensor>& blocks, int block, int layer, int offset) const;
+
+    public:
+        paged_kv_cache(int n_layers, int kv_dim, int block_size, int n_blocks);
+
+        int create();          // a new empty sequence
+        int fork(int seq);     // a new sequence sharing all of seq's positions
+        void release(int seq); // the id may be handed out again
+
+        // make position pos of seq writable, allocating or copying its block as needed
+        void reserve(int seq, int pos);
+        float* key(int layer, int seq, int pos);
+        float* value(int layer, int seq, int pos);
+        // start of every block of seq in layer, to attend over its first n_pos positions
+        void blocks(int layer, int seq, int n_pos, const float** key_blocks, const float** value_blocks) const;
+
+        int block_length() const { return block_size; }
+        int max_length() const { return refs.size() * block_size; } // of one sequence
+        int max_blocks() const { return refs.size(); }
+        int blocks_used() const { return refs.size() - free_blocks.size(); }
+        int blocks_allocated() const;
+        int columns() const { return kv_dim; }
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef __tinyinference_spsc_queue_h
+#define __tinyinference_spsc_queue_h
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. A ring of slots indexed by two counters that only ever grow: the
+// producer owns tail, the consumer owns head, each on its own cache line.
+// push() and pop() try the lock-free path first; when the queue is full or
+// empty they sleep on a condition variable instead of spinning, and the other
+// side takes the mutex to wake them only when one of them is asleep.
+
+template <typename T>
+class spsc_queue {
+    std::vector<T> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0}; // next slot to pop
+    alignas(64) std::atomic<size_t> tail{0}; // next slot to push
+    alignas(64) std::atomic<int> sleepers{0}; // threads in wait()
+    std::mutex mutex;
+    std::condition_variable wakeup;
+
+    // sleep until ready() holds; the counter and the fences pair with wake() so
+    // that either the waker sees a sleeper or the sleeper sees the slot it waits for
+    template <typename Ready>
+    void wait(Ready ready) {
+        std::unique_lock<std::mutex> lock{mutex};
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wakeup.wait(lock, ready);
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock{mutex};
+            wakeup.notify_all();
+        }
+    }
+
+    public:
+        explicit spsc_queue(size_t capacity) {
+            size_t size = 1;
+            while (size < capacity) {
+                size <<= 1;
+            }
+
+            slots.resize(size);
+            mask = size - 1;
+        }
+
+        spsc_queue(const spsc_queue&) = delete;
+        spsc_queue& operator=(const spsc_queue&) = delete;
+
+        bool try_push(const T& val) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) == slots.size()) {
+                return false;
+            }
+
+            slots[t & mask] = val;
+            tail.store(t + 1, std::memory_order_release);
+            wake();
+            return true;
+        }
+
+        bool try_pop(T& val) {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire)) {
+                return false;
+            }
+
+            val = slots[h & mask];
+            head.store(h + 1, std::memory_order_release);
+            wake();
+            return true;
+        }
+
+        void push(const T& val) {
+            while (!try_push(val)) {
+                wait([&] { return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) < slots.size(); });
+            }
+        }
+
+        T pop() {
+            T val;
+            while (!try_pop(val)) {
+                wait([&] { return head.load(std::memory_order_relaxed) != tail.load(std::memory_order_acquire); });
+            }
+
+            return val;
+        }
+};
+
+#endif
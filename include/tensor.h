@@ -2,30 +2,59 @@
 #define __tinyinference_tensor_h
 
 #include <string>
+#include <type_traits>
 #include <utility>
 
+#include "half.h"
+#include "memory.h"
+
+// A tensor either owns its storage or references memory that belongs to someone
+// else (a mmap'd checkpoint, a row of another tensor); ref is true for the latter.
+//  - the shape constructors, copy() and copies allocate and own
+//  - tensor(data, dim) and tensor(data, dim, type) only reference data,
+//    tensor(data, dim, false) takes over a new[] buffer
+//  - moving hands the ownership over, the source is left as a reference
+//  - assigning to a reference of the same size writes through into the referenced
+//    memory, any other assignment replaces the storage (deep copy or move)
+// Owned storage is charged to memory::current() when it is allocated.
+// Arithmetic builds lazy expressions that are evaluated on assignment, see expression.h.
+namespace expression { template <typename T> struct is_node; }
+
 class tensor {
     protected:
         bool ref = true;
         float* m_data;
         std::pair<int, int> dim;
+        dtype m_type = dtype::f32;
+        uint16_t* m_half = nullptr; // storage for f16/bf16 tensors, m_data is null for those
+        memory::category m_category = memory::category::other; // what owned storage is charged to
+
+        void allocate(); // own storage for the current shape and type
+        void release();  // free owned storage, leaves a null reference
+        const void* raw() const { return m_type == dtype::f32 ? (const void*)m_data : (const void*)m_half; }
 
     public:
         tensor();
         tensor(float* data, std::pair<int, int> dim);
         tensor(float* data, std::pair<int, int> dim, bool ref);
+        tensor(void* data, std::pair<int, int> dim, dtype type); // reference to data of any dtype
         tensor(std::pair<int, int> dim, float val);
         tensor(std::pair<int, int> dim);
+        tensor(std::pair<int, int> dim, dtype type); // uninitialized storage of any dtype
         tensor(const tensor& matrix); //copy
         tensor(tensor&& matrix);      //move
+        template <typename E, typename = typename std::enable_if<expression::is_node<E>::value>::type>
+        tensor(const E& expr);        //evaluate
         ~tensor();
 
-        void set_data(float* data, int size);
+        void set_data(float* data, int size); // reference data from now on, freeing owned storage
         void set_shape(std::pair<int,int> n_dim);
-        void set_ref(bool ref);
 
         bool get_ref() const { return ref; }
         float* get_data() const { return m_data; }
+        uint16_t* get_half_data() const { return m_half; }
+        dtype type() const { return m_type; }
+        size_t bytes() const { return size() * dtype_size(m_type); }
 
         inline size_t size() const { return (dim.first * dim.second); }
 		inline size_t rows() const { return dim.first; }
@@ -33,12 +62,13 @@ class tensor {
         std::pair<int, int> shape() const { return dim; }
         
         std::string toString() const;
-        tensor copy();
+        tensor copy() const;
+        tensor to(dtype type) const; // convert; a reference to this tensor if the type already matches
 
         //tensor& slice(size_t index, std::pair<int,int> dim);
-        tensor& operator[] (size_t index) const;
+        tensor operator[] (size_t index) const; // reference to a row
         float& operator[] (std::pair<size_t, size_t> index) const;
-        tensor& operator() (size_t index) const;
+        tensor operator() (size_t index) const;
         float& operator() (std::pair<size_t, size_t> index) const;
         /*
         float& operator() (size_t index);
@@ -46,12 +76,12 @@ class tensor {
         tensor operator[] (size_t index) const;*/
 
 
-        tensor operator+(const tensor& obj) const;
-        tensor operator*(const tensor& obj) const;
-        tensor operator*(const float& obj) const;
-
         tensor& operator=(const tensor& matrix); //copy
 		tensor& operator=(tensor&& matrix);      //move
+        template <typename E, typename = typename std::enable_if<expression::is_node<E>::value>::type>
+        tensor& operator=(const E& expr);        //evaluate
 };
 
+#include "expression.h"
+
 #endif
\ No newline at end of file
@@ -0,0 +1,60 @@
+#ifndef __tinyinference_trace_h
+#define __tinyinference_trace_h
+
+#include <cstdint>
+#include <cstdio>
+
+// Low overhead tracing of the hot path. A scope records its start and end
+// timestamp (rdtsc where available) into a ring buffer owned by the calling
+// thread, no locks are taken while tracing. The events can be exported as a
+// Chrome trace_event JSON (chrome://tracing, perfetto) and summarized per op.
+//
+// Tracing is compiled in with the TINYINFERENCE_ENABLE_TRACING cmake option,
+// otherwise TRACE_SCOPE expands to nothing.
+//
+//   {
+//       TRACE_SCOPE("matmul_wq", layer);
+//       q = xb * query;
+//   }
+
+namespace trace {
+
+struct event {
+    const char* name; // must outlive the trace, string literals in practice
+    int arg;          // layer index or -1
+    uint64_t start;
+    uint64_t end;
+};
+
+uint64_t now(); // timestamp in ticks
+void record(const char* name, int arg, uint64_t start, uint64_t end);
+
+class scope {
+    const char* name;
+    int arg;
+    uint64_t start;
+
+    public:
+        scope(const char* name, int arg = -1) : name{name}, arg{arg}, start{now()} {}
+        ~scope() { record(name, arg, start, now()); }
+};
+
+// events per thread kept before the oldest ones get overwritten
+void set_capacity(size_t events);
+void clear();
+
+// Both read the ring buffers of every thread, call them while no traced code runs.
+bool write_chrome_trace(const char* path);
+void print_summary(FILE* out);
+
+}
+
+#ifdef TINYINFERENCE_TRACING
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(...) trace::scope TRACE_CONCAT(trace_scope_, __LINE__){__VA_ARGS__}
+#else
+#define TRACE_SCOPE(...) do {} while (0)
+#endif
+
+#endif
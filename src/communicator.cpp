@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "communicator.h"
+
+// Segment layout: the header, then two buffers of n_ranks slots of max_floats
+// floats each. Collectives alternate between the buffers, so a rank done with
+// collective i may already write its slot for i + 1 while slower ranks still
+// read the slots of i: nobody gets to i + 2 before every rank passed the
+// barrier of i + 1, which they only reach once done with i.
+
+static const unsigned ready_magic = 0x74706331;
+
+struct shm_communicator::header {
+    std::atomic<unsigned> ready;                   // ready_magic once rank 0 set up the rest
+    int n_ranks;
+    size_t max_floats;
+    alignas(64) std::atomic<int> arrived;          // ranks waiting at the barrier
+    alignas(64) std::atomic<unsigned> generation;  // barriers passed
+};
+
+static const size_t header_bytes = 4 * 64;
+
+static size_t segment_bytes(int n_ranks, size_t max_floats) {
+    return header_bytes + 2 * n_ranks * max_floats * sizeof(float);
+}
+
+static void* map_segment(int fd, size_t bytes) {
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("communicator: mmap failed");
+    }
+    return p;
+}
+
+shm_communicator::shm_communicator(const char* name, int n_ranks, size_t max_floats)
+: name{name}, m_rank{0}, owner{true} {
+    static_assert(sizeof(header) <= header_bytes, "communicator header outgrew its space");
+    if (n_ranks < 1 || max_floats == 0) {
+        throw std::runtime_error("communicator: needs at least one rank and one float");
+    }
+
+    shm_unlink(name); // a stale segment of a crashed run
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("communicator: cannot create ") + name);
+    }
+
+    mapped_bytes = segment_bytes(n_ranks, max_floats);
+    if (ftruncate(fd, mapped_bytes) != 0) {
+        close(fd);
+        shm_unlink(name);
+        throw std::runtime_error("communicator: cannot size the shared memory segment");
+    }
+
+    shared = (header*)map_segment(fd, mapped_bytes);
+    close(fd);
+
+    new (shared) header{}; // the segment starts zeroed, this only makes the atomics official
+    shared->n_ranks = n_ranks;
+    shared->max_floats = max_floats;
+    shared->ready.store(ready_magic, std::memory_order_release);
+}
+
+shm_communicator::shm_communicator(const char* name, int rank)
+: name{name}, m_rank{rank}, owner{false} {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+    while (true) {
+        int fd = shm_open(name, O_RDWR, 0600);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= header_bytes) {
+            header* h = (header*)map_segment(fd, header_bytes);
+            if (h->ready.load(std::memory_order_acquire) == ready_magic) {
+                mapped_bytes = segment_bytes(h->n_ranks, h->max_floats);
+                munmap(h, header_bytes);
+                shared = (header*)map_segment(fd, mapped_bytes);
+                close(fd);
+                break;
+            }
+            munmap(h, header_bytes);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        if (std::chrono::steady_clock::now() > deadline) {
+            throw std::runtime_error(std::string("communicator: no segment ") + name);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    if (rank < 0 || rank >= shared->n_ranks) {
+        throw std::runtime_error("communicator: rank out of range");
+    }
+}
+
+shm_communicator::~shm_communicator() {
+    if (shared) {
+        munmap(shared, mapped_bytes);
+    }
+    if (owner) {
+        shm_unlink(name.c_str());
+    }
+}
+
+void shm_communicator::set_rank(int rank) {
+    if (rank < 0 || rank >= size()) {
+        throw std::runtime_error("communicator: rank out of range");
+    }
+    m_rank = rank;
+    owner = rank == 0;
+}
+
+int shm_communicator::size() const {
+    return shared->n_ranks;
+}
+
+float* shm_communicator::slot(unsigned buffer, int rank) const {
+    float* slots = (float*)((char*)shared + header_bytes);
+    return slots + (buffer * shared->n_ranks + rank) * shared->max_floats;
+}
+
+void shm_communicator::barrier() {
+    unsigned generation = shared->generation.load(std::memory_order_acquire);
+    if (shared->arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == shared->n_ranks) {
+        shared->arrived.store(0, std::memory_order_relaxed);
+        shared->generation.fetch_add(1, std::memory_order_release);
+        return;
+    }
+
+    while (shared->generation.load(std::memory_order_acquire) == generation) {
+        std::this_thread::yield();
+    }
+}
+
+void shm_communicator::all_reduce(float* data, size_t n) {
+    size_t max_floats = shared->max_floats;
+    for (size_t begin = 0 ; begin < n ; begin += max_floats) {
+        size_t count = std::min(max_floats, n - begin);
+        unsigned buffer = phase++ & 1;
+        memcpy(slot(buffer, m_rank), data + begin, count * sizeof(float));
+        barrier();
+
+        // every rank adds in rank order, so all of them end up with the same floats
+        float* sum = data + begin;
+        memcpy(sum, slot(buffer, 0), count * sizeof(float));
+        for (int r = 1 ; r < shared->n_ranks ; r++) {
+            const float* part = slot(buffer, r);
+            for (size_t i = 0 ; i < count ; i++) {
+                sum[i] += part[i];
+            }
+        }
+    }
+}
+
+void shm_communicator::all_gather(const float* local, size_t offset, size_t n, float* out, size_t total) {
+    // the slots of a buffer are contiguous, a gather uses them as one array
+    if (total > shared->n_ranks * shared->max_floats || offset + n > total) {
+        throw std::runtime_error("communicator: all_gather larger than the segment");
+    }
+
+    unsigned buffer = phase++ & 1;
+    float* gathered = slot(buffer, 0);
+    memcpy(gathered + offset, local, n * sizeof(float));
+    barrier();
+    memcpy(out, gathered, total * sizeof(float));
+}
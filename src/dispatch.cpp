@@ -0,0 +1,136 @@
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "dispatch.h"
+#include "half.h"
+#include "kernels/kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t xgetbv0() {
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+}
+#endif
+
+static cpu_features detect_features() {
+    cpu_features f;
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return f;
+    }
+
+    bool osxsave = ecx & bit_OSXSAVE;
+    bool fma = ecx & bit_FMA;
+    bool f16c = ecx & bit_F16C;
+    if (!osxsave) {
+        return f;
+    }
+
+    // the OS has to save the YMM (and for AVX-512 the opmask/ZMM) state on context switches
+    uint64_t xcr0 = xgetbv0();
+    bool ymm_state = (xcr0 & 0x6) == 0x6;
+    bool zmm_state = (xcr0 & 0xe6) == 0xe6;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return f;
+    }
+
+    f.avx2 = ymm_state && (ebx & bit_AVX2);
+    f.fma = ymm_state && fma;
+    f.f16c = ymm_state && f16c;
+    f.avx512f = zmm_state && (ebx & bit_AVX512F);
+    f.avx512bw = zmm_state && (ebx & bit_AVX512BW);
+    f.avx512vl = zmm_state && (ebx & bit_AVX512VL);
+    f.avx512_vnni = zmm_state && (ecx & bit_AVX512VNNI);
+
+    if (__get_cpuid_count(7, 1, &eax, &ebx, &ecx, &edx)) {
+        f.avx512_bf16 = zmm_state && (eax & bit_AVX512BF16);
+    }
+#endif
+    return f;
+}
+
+const cpu_features& host_features() {
+    static const cpu_features features = detect_features();
+    return features;
+}
+
+isa host_isa() {
+    const cpu_features& f = host_features();
+    bool avx2 = f.avx2 && f.fma && f.f16c;
+    if (avx2 && f.avx512f && f.avx512bw && f.avx512vl) {
+        return isa::avx512;
+    }
+
+    if (avx2) {
+        return isa::avx2;
+    }
+
+    return isa::generic;
+}
+
+static const kernel_table* table_for(isa level) {
+#ifdef TINYINFERENCE_X86_KERNELS
+    isa best = host_isa();
+    if ((int)level > (int)best) {
+        level = best;
+    }
+
+    switch (level) {
+        case isa::avx512: return &avx512_kernels;
+        case isa::avx2: return &avx2_kernels;
+        default: return &generic_kernels;
+    }
+#else
+    (void)level;
+    return &generic_kernels;
+#endif
+}
+
+static isa requested_isa() {
+    const char* env = getenv("TINYINFERENCE_ISA");
+    if (env == nullptr || *env == '\0') {
+        return host_isa();
+    }
+
+    std::string name{env};
+    if (name == "generic") { return isa::generic; }
+    if (name == "avx2") { return isa::avx2; }
+    if (name == "avx512") { return isa::avx512; }
+    throw std::runtime_error("Unknown TINYINFERENCE_ISA value " + name + ", expected generic, avx2 or avx512.");
+}
+
+static std::atomic<const kernel_table*> active{nullptr};
+
+const kernel_table& kernels() {
+    const kernel_table* table = active.load(std::memory_order_acquire);
+    if (table == nullptr) {
+        table = table_for(requested_isa());
+        active.store(table, std::memory_order_release);
+    }
+
+    return *table;
+}
+
+void set_kernels(isa level) {
+    active.store(table_for(level), std::memory_order_release);
+}
+
+// the half precision entry points of half.h route through the table too
+
+void matmul_f16(float* out, const float* x, const uint16_t* w, int m, int n, int k) {
+    kernels().matmul_f16(out, x, w, m, n, k);
+}
+
+void matmul_bf16(float* out, const float* x, const uint16_t* w, int m, int n, int k) {
+    kernels().matmul_bf16(out, x, w, m, n, k);
+}
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <cstring>
 
 #include "encoder/bpe.h"
 
@@ -8,7 +9,6 @@ bpe::bpe(std::string tokenizer_path, int vocab_size) : encoder(vocab_size) {
     vocab = std::vector<std::string>(vocab_size);
     int len;
     float score;
-    char buf[max_token_length * 2 + 3];
 
     for (int i = 0 ; i < 256 ; i++) {
         byte_pieces[i*2] = (unsigned char)i;
@@ -18,11 +18,12 @@ bpe::bpe(std::string tokenizer_path, int vocab_size) : encoder(vocab_size) {
     std::fstream file{tokenizer_path};
     if (!file) { throw std::runtime_error("Unable to open the tokenizer file tokenizer.bin!"); }
     file.read((char *)&max_token_length, sizeof(int));
+    std::vector<char> buf(max_token_length * 2 + 3);
     for (int i = 0 ; i < vocab_size; i++) {
         file.read((char *)&score, sizeof(float));
         file.read((char *)&len, sizeof(int));     
-        file.read(buf, len * sizeof(char));
-        std::string temp{buf, static_cast<unsigned long>(len)};
+        file.read(buf.data(), len * sizeof(char));
+        std::string temp{buf.data(), static_cast<unsigned long>(len)};
         vocab_scores[temp] = {i, score};
         vocab[i] = temp;
     }
@@ -163,7 +164,16 @@ std::string bpe::decode(int prev_token, int token) {
     return result;
 }
 
-void bpe::safe_printf(std::string text) {
+std::string bpe::text(int token) const {
+    unsigned char byte_val;
+    if (sscanf(vocab[token].c_str(), "<0x%02hhX>", &byte_val) == 1) {
+        return std::string(1, (char)byte_val);
+    }
+
+    return vocab[token];
+}
+
+bool bpe::printable(const std::string& text) {
     // piece might be a raw byte token, and we only want to print printable chars or whitespace
     // because some of the other bytes can be various control codes, backspace, etc.
     if (text.size() > 0) {
@@ -171,11 +181,19 @@ void bpe::safe_printf(std::string text) {
             if (text[1] == '\0') {
                 unsigned char byte_val = text[0];
                 if (!(isprint(byte_val) || isspace(byte_val))) {
-                    return; // bad byte, don't print it
+                    return false; // bad byte, don't print it
                 }
             }
 
-            std::cout << text;
+            return true;
         }
     }
+
+    return false;
+}
+
+void bpe::safe_printf(std::string text) {
+    if (printable(text)) {
+        std::cout << text;
+    }
 }
\ No newline at end of file
@@ -0,0 +1,835 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include "communicator.h"
+#include "graph.h"
+#include "lora.h"
+#include "memory.h"
+#include "trace.h"
+
+// workspace offsets are rounded to a cache line
+static size_t align(size_t floats) {
+    return (floats + 15) & ~(size_t)15;
+}
+
+graph::value graph::append(node n) {
+    n.layer = current_layer;
+    nodes.push_back(n);
+    compiled = false;
+    return nodes.size() - 1;
+}
+
+const graph::node& graph::at(value v) const {
+    if (v < 0 || v >= (value)nodes.size() || nodes[v].type == op::hook) {
+        throw std::runtime_error("graph: not a value");
+    }
+
+    return nodes[v];
+}
+
+graph::value graph::input(const tensor& x) {
+    node n{op::input, "input"};
+    n.weight = &x;
+    n.size = x.columns();
+    return append(n);
+}
+
+graph::value graph::embedding(const tensor& table) {
+    node n{op::embedding, "embedding"};
+    n.weight = &table;
+    n.size = table.columns();
+    return append(n);
+}
+
+graph::value graph::rms_norm(value x, const tensor& weight, float eps) {
+    if (weight.type() != dtype::f32 || (int)weight.size() != at(x).size) {
+        throw std::runtime_error("graph: rms_norm weight does not match the input");
+    }
+
+    node n{op::rms_norm, "rms_norm"};
+    n.a = x;
+    n.weight = &weight;
+    n.size = at(x).size;
+    n.eps = eps;
+    return append(n);
+}
+
+graph::value graph::linear(value x, const tensor& weight, const char* name) {
+    if ((int)weight.columns() != at(x).size) {
+        throw std::runtime_error("Matrix dimensions are not compatible.");
+    }
+
+    node n{op::linear, name};
+    n.a = x;
+    n.weight = &weight;
+    n.size = weight.rows();
+    return append(n);
+}
+
+graph::value graph::swiglu(value x, const tensor& w13, const char* name) {
+    if ((int)w13.columns() != at(x).size || w13.rows() % 2 != 0) {
+        throw std::runtime_error("Matrix dimensions are not compatible.");
+    }
+
+    node n{op::swiglu, name};
+    n.a = x;
+    n.weight = &w13;
+    n.size = w13.rows() / 2;
+    return append(n);
+}
+
+graph::value graph::sparse_linear(value x, const tensor& wt, float threshold, int top_k, const char* name) {
+    if ((int)wt.rows() != at(x).size) {
+        throw std::runtime_error("Matrix dimensions are not compatible.");
+    }
+
+    node n{op::sparse_linear, name};
+    n.a = x;
+    n.weight = &wt;
+    n.size = wt.columns();
+    n.threshold = threshold;
+    n.top_k = std::min(top_k, at(x).size);
+    return append(n);
+}
+
+graph::value graph::slice(value x, int offset, int size) {
+    if (offset < 0 || size <= 0 || offset + size > at(x).size) {
+        throw std::runtime_error("graph: slice out of range");
+    }
+
+    node n{op::slice, "slice"};
+    n.a = x;
+    n.offset = offset;
+    n.size = size;
+    return append(n);
+}
+
+graph::value graph::rope(value x, int head_size) {
+    if (head_size % 2 != 0 || at(x).size % head_size != 0) {
+        throw std::runtime_error("graph: rope head size does not divide the input");
+    }
+
+    node n{op::rope, "rope"};
+    n.a = x;
+    n.size = at(x).size;
+    n.head_size = head_size;
+    return append(n);
+}
+
+graph::value graph::attention(value q, value k, value v, tensor& key_cache, tensor& value_cache,
+                              int n_heads, int n_kv_heads, int sinks, tensor* sink_keys) {
+    int kv_dim = key_cache.columns();
+    if (n_heads % n_kv_heads != 0 || at(q).size % n_heads != 0 || at(k).size != kv_dim || at(v).size != kv_dim ||
+        value_cache.shape() != key_cache.shape() || kv_dim != (at(q).size / n_heads) * n_kv_heads) {
+        throw std::runtime_error("graph: attention shapes are not compatible");
+    }
+
+    if (sinks >= (int)key_cache.rows()) {
+        throw std::runtime_error("graph: no room for a window after the attention sinks");
+    }
+
+    if (sinks > 0 && (!sink_keys || (int)sink_keys->rows() != sinks || (int)sink_keys->columns() != kv_dim)) {
+        throw std::runtime_error("graph: attention sinks need a [sinks x kv_dim] buffer for their keys");
+    }
+
+    node n{op::attention, "attention"};
+    n.a = q;
+    n.b = k;
+    n.c = v;
+    n.size = at(q).size;
+    n.key_cache = &key_cache;
+    n.value_cache = &value_cache;
+    n.n_heads = n_heads;
+    n.n_kv_heads = n_kv_heads;
+    n.head_size = at(q).size / n_heads;
+    n.sinks = sinks;
+    n.sink_keys = sink_keys;
+    return append(n);
+}
+
+graph::value graph::attention(value q, value k, value v, paged_kv_cache& cache, int layer, int n_heads, int n_kv_heads) {
+    int kv_dim = cache.columns();
+    if (n_heads % n_kv_heads != 0 || at(q).size % n_heads != 0 || at(k).size != kv_dim || at(v).size != kv_dim ||
+        kv_dim != (at(q).size / n_heads) * n_kv_heads) {
+        throw std::runtime_error("graph: attention shapes are not compatible");
+    }
+
+    node n{op::attention, "attention"};
+    n.a = q;
+    n.b = k;
+    n.c = v;
+    n.size = at(q).size;
+    n.pages = &cache;
+    n.cache_layer = layer;
+    n.n_heads = n_heads;
+    n.n_kv_heads = n_kv_heads;
+    n.head_size = at(q).size / n_heads;
+    return append(n);
+}
+
+graph::value graph::silu(value x) {
+    node n{op::silu, "silu"};
+    n.a = x;
+    n.size = at(x).size;
+    return append(n);
+}
+
+graph::value graph::mul(value a, value b) {
+    if (at(a).size != at(b).size) {
+        throw std::runtime_error("graph: mul of different sizes");
+    }
+
+    node n{op::mul, "mul"};
+    n.a = a;
+    n.b = b;
+    n.size = at(a).size;
+    return append(n);
+}
+
+graph::value graph::add(value a, value b) {
+    if (at(a).size != at(b).size) {
+        throw std::runtime_error("graph: add of different sizes");
+    }
+
+    node n{op::add, "add"};
+    n.a = a;
+    n.b = b;
+    n.size = at(a).size;
+    return append(n);
+}
+
+graph::value graph::lora(value y, value x, const lora_bank& bank, int slot, int offset, const char* name) {
+    if (offset < 0 || offset >= at(y).size) {
+        throw std::runtime_error("graph: lora out of range");
+    }
+
+    at(x);
+    node n{op::lora, name};
+    n.a = y;
+    n.b = x;
+    n.size = at(y).size;
+    n.offset = offset;
+    n.bank = &bank;
+    n.slot = slot;
+    return append(n);
+}
+
+graph::value graph::all_reduce(value x, shm_communicator& comm) {
+    node n{op::all_reduce, "all_reduce"};
+    n.a = x;
+    n.size = at(x).size;
+    n.comm = &comm;
+    return append(n);
+}
+
+graph::value graph::all_gather(value x, shm_communicator& comm, int offset, int size) {
+    if (offset < 0 || offset + at(x).size > size) {
+        throw std::runtime_error("graph: all_gather out of range");
+    }
+
+    node n{op::all_gather, "all_gather"};
+    n.a = x;
+    n.size = size;
+    n.offset = offset;
+    n.comm = &comm;
+    return append(n);
+}
+
+void graph::hook(std::function<void()> fn) {
+    node n{op::hook, "hook"};
+    n.fn = fn;
+    append(n);
+}
+
+void graph::set_layer(int layer) {
+    current_layer = layer;
+}
+
+void graph::output(value x) {
+    at(x);
+    out = x;
+    compiled = false;
+}
+
+// silu(x) only used by a mul becomes part of the mul, one pass instead of two
+void graph::fuse() {
+    std::vector<int> uses(nodes.size(), 0);
+    for (const node& n : nodes) {
+        for (value v : {n.a, n.b, n.c}) {
+            if (v >= 0 && !n.skip) {
+                uses[v]++;
+            }
+        }
+    }
+
+    for (node& n : nodes) {
+        if (n.type != op::mul || n.skip) {
+            continue;
+        }
+
+        for (int side = 0 ; side < 2 ; side++) {
+            value s = side == 0 ? n.a : n.b;
+            value other = side == 0 ? n.b : n.a;
+            if (nodes[s].type == op::silu && uses[s] == 1 && s != out) {
+                nodes[s].skip = true;
+                n.type = op::silu_mul;
+                n.name = "silu_mul";
+                n.a = nodes[s].a;
+                n.b = other;
+                break;
+            }
+        }
+    }
+}
+
+bool graph::overlaps(value u, value v) const {
+    const node& a = nodes[u];
+    const node& b = nodes[v];
+    return a.root == b.root && a.base < b.base + b.size && b.base < a.base + a.size;
+}
+
+void graph::plan() {
+    const int count = nodes.size();
+    for (node& n : nodes) {
+        n.last_use = -1;
+        n.root = -1;
+        n.base = 0;
+    }
+
+    for (int i = 0 ; i < count ; i++) {
+        if (nodes[i].skip) {
+            continue;
+        }
+
+        for (value v : {nodes[i].a, nodes[i].b, nodes[i].c}) {
+            if (v >= 0) {
+                nodes[v].last_use = i;
+            }
+        }
+    }
+
+    nodes[out].last_use = count; // the output is read after the run
+
+    // storage: views and in place ops live in the storage of their input
+    for (int i = 0 ; i < count ; i++) {
+        node& n = nodes[i];
+        if (n.skip || n.type == op::hook) {
+            continue;
+        }
+
+        if (n.type == op::slice) {
+            n.root = nodes[n.a].root;
+            n.base = nodes[n.a].base + n.offset;
+            continue;
+        }
+
+        n.root = i;
+        bool in_place = n.type == op::rms_norm || n.type == op::rope || n.type == op::silu ||
+                        n.type == op::mul || n.type == op::add || n.type == op::silu_mul ||
+                        n.type == op::all_reduce || n.type == op::lora;
+        if (!in_place || nodes[n.a].last_use != i || nodes[n.a].size != n.size) {
+            continue;
+        }
+
+        // nothing still needed may share the memory we would write over
+        bool safe = n.b < 0 || !overlaps(n.a, n.b) || nodes[n.b].base == nodes[n.a].base;
+        for (int u = 0 ; u < i && safe ; u++) {
+            if (u != n.a && !nodes[u].skip && nodes[u].root >= 0 && overlaps(u, n.a) && nodes[u].last_use > i) {
+                safe = false;
+            }
+        }
+
+        if (safe) {
+            n.root = nodes[n.a].root;
+            n.base = nodes[n.a].base;
+        }
+    }
+
+    // lifetime of every root, from its op to the last use of anything living in it
+    std::vector<int> end(count, -1);
+    for (int i = 0 ; i < count ; i++) {
+        if (nodes[i].root >= 0) {
+            end[nodes[i].root] = std::max({end[nodes[i].root], i, nodes[i].last_use});
+        }
+    }
+
+    // greedy placement, biggest first, at the lowest offset free over the whole lifetime
+    std::vector<value> roots;
+    for (int i = 0 ; i < count ; i++) {
+        if (nodes[i].root == i) {
+            roots.push_back(i);
+        }
+    }
+
+    std::stable_sort(roots.begin(), roots.end(), [&](value a, value b) {
+        return nodes[a].size > nodes[b].size;
+    });
+
+    std::vector<value> placed;
+    size_t total = 0;
+    for (value r : roots) {
+        std::vector<value> live;
+        for (value p : placed) {
+            if (p <= end[r] && r <= end[p]) {
+                live.push_back(p);
+            }
+        }
+
+        std::sort(live.begin(), live.end(), [&](value a, value b) {
+            return nodes[a].position < nodes[b].position;
+        });
+
+        // every row of a value, batch of them
+        auto floats = [&](value v) { return (size_t)nodes[v].size * batch; };
+        size_t position = 0;
+        for (value p : live) {
+            if (position + floats(r) <= nodes[p].position) {
+                break;
+            }
+
+            position = std::max(position, align(nodes[p].position + floats(p)));
+        }
+
+        nodes[r].position = position;
+        total = std::max(total, position + floats(r));
+        placed.push_back(r);
+    }
+
+    int seq_len = 1;
+    size_t block_pointers = 0;
+    for (const node& n : nodes) {
+        if (n.type == op::attention && n.pages) {
+            seq_len = std::max(seq_len, n.pages->max_length());
+            block_pointers = std::max(block_pointers, 2 * (size_t)n.n_kv_heads * n.pages->max_blocks());
+        } else if (n.type == op::attention) {
+            seq_len = std::max(seq_len, (int)n.key_cache->rows());
+        }
+    }
+
+    size_t sparse = 0;
+    size_t rank = 0;
+    for (const node& n : nodes) {
+        if (n.type == op::sparse_linear) {
+            sparse = std::max(sparse, (size_t)nodes[n.a].size);
+        } else if (n.type == op::lora) {
+            rank = lora_bank::max_supported_rank; // adapters may come after compiling
+        }
+    }
+
+    workspace = tensor{{1, (int)std::max<size_t>(total, 1)}};
+    att = tensor{{1, seq_len}};
+    blocks.resize(block_pointers);
+    selected.resize(sparse);
+    low_rank.resize(rank);
+    sparse_inputs = 0;
+    sparse_kept = 0;
+}
+
+void graph::compile(int batch) {
+    if (out < 0) {
+        throw std::runtime_error("graph: no output");
+    }
+
+    if (batch < 1) {
+        throw std::runtime_error("graph: empty batch");
+    }
+
+    this->batch = batch;
+    rows = 1;
+    tokens.assign(batch, 0);
+    positions.assign(batch, 0);
+    sequences.assign(batch, 0);
+    adapters.assign(batch, -1);
+
+    // kernels specialized for the sizes of each op, picked once
+    for (node& n : nodes) {
+        switch (n.type) {
+            case op::rms_norm: n.norm = kernels().rms_norm_for(n.size); break;
+            case op::rope: n.rotate = kernels().rope_for(n.head_size); break;
+            case op::attention:
+                n.attend = kernels().attend_for(n.head_size);
+                n.attend_paged = kernels().attend_paged_for(n.head_size);
+                n.rotate = kernels().rope_for(n.head_size);
+                break;
+            default: break;
+        }
+    }
+
+    fuse();
+    plan();
+    compiled = true;
+}
+
+float* graph::data(value v, int row) {
+    return workspace.get_data() + nodes[nodes[v].root].position + (size_t)row * stride(v) + nodes[v].base;
+}
+
+int graph::stride(value v) const {
+    return nodes[nodes[v].root].size;
+}
+
+static float silu(float x) {
+    return x * (1.0f / (1.0f + expf(-x)));
+}
+
+void graph::matmul(const node& n, float* y, const float* x, int m) {
+    const kernel_table& k = kernels();
+    const int columns = n.weight->columns();
+    switch (n.weight->type()) {
+        case dtype::f16:
+            (n.type == op::linear ? k.matmul_f16 : k.swiglu_f16)(y, x, n.weight->get_half_data(), m, n.size, columns);
+            break;
+        case dtype::bf16:
+            (n.type == op::linear ? k.matmul_bf16 : k.swiglu_bf16)(y, x, n.weight->get_half_data(), m, n.size, columns);
+            break;
+        default:
+            (n.type == op::linear ? k.matmul_f32 : k.swiglu_f32)(y, x, n.weight->get_data(), m, n.size, columns);
+    }
+}
+
+void graph::execute(node& n) {
+    const value self = &n - nodes.data();
+    switch (n.type) {
+        case op::hook:
+            n.fn();
+            break;
+        case op::linear:
+        case op::swiglu:
+            // every row in one call when they are contiguous, each weight is read once for all
+            if (stride(n.a) == nodes[n.a].size) {
+                matmul(n, data(self), data(n.a), rows);
+            } else {
+                for (int r = 0 ; r < rows ; r++) {
+                    matmul(n, data(self, r), data(n.a, r), 1);
+                }
+            }
+            break;
+        default:
+            for (int r = 0 ; r < rows ; r++) {
+                execute(n, r);
+            }
+    }
+}
+
+void graph::execute(node& n, int row) {
+    float* y = data(&n - nodes.data(), row);
+    const int pos = positions[row];
+    switch (n.type) {
+        case op::input:
+            if (row >= (int)n.weight->rows()) {
+                throw std::runtime_error("graph: fewer input rows than the batch");
+            }
+
+            memcpy(y, n.weight->get_data() + (size_t)row * n.size, n.size * sizeof(float));
+            break;
+        case op::embedding: {
+            const int token = tokens[row];
+            if (token < 0 || token >= (int)n.weight->rows()) {
+                throw std::runtime_error("graph: token out of range");
+            }
+
+            if (n.weight->type() == dtype::f32) {
+                memcpy(y, n.weight->get_data() + (size_t)token * n.size, n.size * sizeof(float));
+            } else {
+                to_fp32(y, n.weight->get_half_data() + (size_t)token * n.size, n.size, n.weight->type());
+            }
+            break;
+        }
+        case op::rms_norm:
+            n.norm(y, data(n.a, row), n.weight->get_data(), n.size, n.eps);
+            break;
+        case op::sparse_linear: {
+            const float* x = data(n.a, row);
+            const int k = nodes[n.a].size;
+            int count = 0;
+            if (n.top_k > 0) {
+                for (int i = 0 ; i < k ; i++) {
+                    selected[i] = i;
+                }
+
+                std::nth_element(selected.begin(), selected.begin() + n.top_k, selected.begin() + k,
+                                 [x](int a, int b) { return fabsf(x[a]) > fabsf(x[b]); });
+                count = n.top_k;
+                std::sort(selected.begin(), selected.begin() + count); // rows in memory order
+            } else {
+                for (int i = 0 ; i < k ; i++) {
+                    if (fabsf(x[i]) > n.threshold) {
+                        selected[count++] = i;
+                    }
+                }
+            }
+
+            sparse_inputs += k;
+            sparse_kept += count;
+            const kernel_table& kt = kernels();
+            switch (n.weight->type()) {
+                case dtype::f16:
+                    kt.sparse_matmul_f16(y, x, n.weight->get_half_data(), selected.data(), count, n.size);
+                    break;
+                case dtype::bf16:
+                    kt.sparse_matmul_bf16(y, x, n.weight->get_half_data(), selected.data(), count, n.size);
+                    break;
+                default:
+                    kt.sparse_matmul_f32(y, x, n.weight->get_data(), selected.data(), count, n.size);
+            }
+            break;
+        }
+        case op::rope:
+            if (y != data(n.a, row)) {
+                memcpy(y, data(n.a, row), n.size * sizeof(float));
+            }
+
+            n.rotate(y, nullptr, n.size, 0, n.head_size, pos);
+            break;
+        case op::attention:
+            if (n.pages) {
+                attend_paged(n, y, row);
+                break;
+            }
+
+            if (rows > 1) {
+                throw std::runtime_error("graph: a batch needs the paged attention");
+            }
+            attend(n, y, pos);
+            break;
+        case op::silu: {
+            const float* x = data(n.a, row);
+            for (int i = 0 ; i < n.size ; i++) {
+                y[i] = ::silu(x[i]);
+            }
+            break;
+        }
+        case op::mul: {
+            const float* a = data(n.a, row);
+            const float* b = data(n.b, row);
+            for (int i = 0 ; i < n.size ; i++) {
+                y[i] = a[i] * b[i];
+            }
+            break;
+        }
+        case op::add: {
+            const float* a = data(n.a, row);
+            const float* b = data(n.b, row);
+            for (int i = 0 ; i < n.size ; i++) {
+                y[i] = a[i] + b[i];
+            }
+            break;
+        }
+        case op::silu_mul: {
+            const float* a = data(n.a, row);
+            const float* b = data(n.b, row);
+            for (int i = 0 ; i < n.size ; i++) {
+                y[i] = ::silu(a[i]) * b[i];
+            }
+            break;
+        }
+        case op::all_reduce:
+            if (y != data(n.a, row)) {
+                memcpy(y, data(n.a, row), n.size * sizeof(float));
+            }
+
+            n.comm->all_reduce(y, n.size);
+            break;
+        case op::lora: {
+            if (y != data(n.a, row)) {
+                memcpy(y, data(n.a, row), n.size * sizeof(float));
+            }
+
+            const lora_bank::pair* p = n.bank->find(adapters[row], n.slot);
+            if (!p) {
+                break;
+            }
+
+            const int rank = p->a.rows();
+            if ((int)p->a.columns() != at(n.b).size || n.offset + (int)p->b.rows() > n.size) {
+                throw std::runtime_error("graph: lora pair does not fit its slot");
+            }
+
+            // x * A^T into rank floats, then every output row of B against them
+            const kernel_table& kt = kernels();
+            kt.matmul_f32(low_rank.data(), data(n.b, row), p->a.get_data(), 1, rank, p->a.columns());
+            const float* b = p->b.get_data();
+            for (int i = 0 ; i < (int)p->b.rows() ; i++) {
+                y[n.offset + i] += p->scale * kt.dot(b + (size_t)i * rank, low_rank.data(), rank);
+            }
+            break;
+        }
+        case op::all_gather:
+            n.comm->all_gather(data(n.a, row), n.offset, at(n.a).size, y, n.size);
+            break;
+        default:
+            break;
+    }
+}
+
+void graph::attend(node& n, float* y, int pos) {
+    const int kv_dim = n.key_cache->columns();
+    const int kv_mul = n.n_heads / n.n_kv_heads;
+    const int rows = n.key_cache->rows();
+    if (pos < 0 || (n.sinks < 0 && pos >= rows)) {
+        throw std::runtime_error("graph: position past the end of the kv cache");
+    }
+
+    // sliding window: sinks in the first rows, then the others wrapping around
+    int slot = pos;
+    if (n.sinks >= 0 && pos >= rows) {
+        slot = n.sinks + (pos - n.sinks) % (rows - n.sinks);
+    }
+
+    float* key_cache = n.key_cache->get_data();
+    float* value_cache = n.value_cache->get_data();
+    memcpy(key_cache + (size_t)slot * kv_dim, data(n.b), kv_dim * sizeof(float));
+    memcpy(value_cache + (size_t)slot * kv_dim, data(n.c), kv_dim * sizeof(float));
+    if (pos < n.sinks) {
+        memcpy(n.sink_keys->get_data() + (size_t)pos * kv_dim, data(n.b), kv_dim * sizeof(float));
+    }
+
+    // The window keys keep their rotation: the distance to the query is the same in
+    // positions and in slots. The sinks moved closer, rotate them on by what was dropped.
+    if (n.sinks > 0 && pos >= rows) {
+        int shift = pos - (rows - 1);
+        for (int s = 0 ; s < n.sinks ; s++) {
+            float* key = key_cache + (size_t)s * kv_dim;
+            memcpy(key, n.sink_keys->get_data() + (size_t)s * kv_dim, kv_dim * sizeof(float));
+            n.rotate(key, nullptr, kv_dim, 0, n.head_size, shift);
+        }
+    }
+
+    // the order of the rows does not matter to attention, the ring is read as it is
+    const int len = std::min(pos + 1, rows);
+    const float* q = data(n.a);
+    for (int h = 0 ; h < n.n_heads ; h++) {
+        int kv_offset = (h / kv_mul) * n.head_size;
+        n.attend(y + h * n.head_size, q + h * n.head_size, key_cache + kv_offset, value_cache + kv_offset,
+                 kv_dim, att.get_data(), len, n.head_size);
+    }
+}
+
+void graph::attend_paged(node& n, float* y, int row) {
+    paged_kv_cache& cache = *n.pages;
+    const int seq = sequences[row];
+    const int pos = positions[row];
+    const int kv_dim = cache.columns();
+    const int kv_mul = n.n_heads / n.n_kv_heads;
+    if (pos < 0 || pos >= cache.max_length()) {
+        throw std::runtime_error("graph: position past the end of the kv cache");
+    }
+
+    // the first layer to get there copies a shared block, the others find it done
+    cache.reserve(seq, pos);
+    memcpy(cache.key(n.cache_layer, seq, pos), data(n.b, row), kv_dim * sizeof(float));
+    memcpy(cache.value(n.cache_layer, seq, pos), data(n.c, row), kv_dim * sizeof(float));
+
+    // block starts offset to every kv head: keys of head h in blocks[2 * h * n_blocks ...]
+    const int n_blocks = pos / cache.block_length() + 1;
+    cache.blocks(n.cache_layer, seq, pos + 1, blocks.data(), blocks.data() + n_blocks);
+    for (int h = n.n_kv_heads - 1 ; h >= 0 ; h--) {
+        for (int i = 0 ; i < 2 * n_blocks ; i++) {
+            blocks[2 * h * n_blocks + i] = blocks[i] + h * n.head_size;
+        }
+    }
+
+    const float* q = data(n.a, row);
+    for (int h = 0 ; h < n.n_heads ; h++) {
+        const float** head_blocks = blocks.data() + 2 * (h / kv_mul) * n_blocks;
+        n.attend_paged(y + h * n.head_size, q + h * n.head_size, head_blocks, head_blocks + n_blocks,
+                       cache.block_length(), kv_dim, att.get_data(), pos + 1, n.head_size);
+    }
+}
+
+tensor graph::step() {
+    for (node& n : nodes) {
+        if (n.skip || n.type == op::slice) {
+            continue;
+        }
+
+        TRACE_SCOPE(n.name, n.layer);
+        execute(n);
+    }
+
+    return result();
+}
+
+tensor graph::run(int token, int pos, int adapter) {
+    if (!compiled) {
+        compile(batch);
+    }
+
+    rows = 1;
+    tokens[0] = token;
+    positions[0] = pos;
+    sequences[0] = 0;
+    adapters[0] = adapter;
+    return step();
+}
+
+tensor graph::run(const std::vector<int>& tokens, const std::vector<int>& positions, const std::vector<int>& sequences,
+                  const std::vector<int>& adapters) {
+    if (!compiled) {
+        compile(batch);
+    }
+
+    const int count = tokens.size();
+    if (count < 1 || count > batch || (int)positions.size() != count ||
+        (!sequences.empty() && (int)sequences.size() != count) || (!adapters.empty() && (int)adapters.size() != count)) {
+        throw std::runtime_error("graph: run does not match the batch");
+    }
+
+    rows = count;
+    std::copy(tokens.begin(), tokens.end(), this->tokens.begin());
+    std::copy(positions.begin(), positions.end(), this->positions.begin());
+    for (int r = 0 ; r < count ; r++) {
+        this->sequences[r] = sequences.empty() ? r : sequences[r];
+        this->adapters[r] = adapters.empty() ? -1 : adapters[r];
+    }
+
+    return step();
+}
+
+tensor graph::result() {
+    if (!compiled) {
+        throw std::runtime_error("graph: not compiled");
+    }
+
+    if (rows > 1 && stride(out) != nodes[out].size) {
+        throw std::runtime_error("graph: the output rows are not contiguous");
+    }
+
+    return tensor{data(out), {rows, nodes[out].size}};
+}
+
+size_t graph::workspace_bytes() const {
+    return workspace.size() * sizeof(float);
+}
+
+size_t graph::unplanned_bytes() const {
+    size_t bytes = 0;
+    for (const node& n : nodes) {
+        if (n.type != op::slice && n.type != op::hook) {
+            bytes += (size_t)n.size * batch * sizeof(float);
+        }
+    }
+
+    return bytes;
+}
+
+double graph::sparse_density() const {
+    return sparse_inputs ? (double)sparse_kept / sparse_inputs : 1.0;
+}
+
+void graph::print_plan(FILE* out) const {
+    fprintf(out, "%5s %-12s %6s %8s %6s %10s\n", "value", "op", "layer", "floats", "root", "offset");
+    for (size_t i = 0 ; i < nodes.size() ; i++) {
+        const node& n = nodes[i];
+        if (n.skip || n.type == op::hook) {
+            continue;
+        }
+
+        fprintf(out, "%5zu %-12s %6d %8d %6d %10zu\n", i, n.name, n.layer, n.size, n.root,
+                nodes[n.root].position + n.base);
+    }
+
+    fprintf(out, "workspace %zu bytes for %d rows, %zu without reuse\n", workspace_bytes(), batch, unplanned_bytes());
+}
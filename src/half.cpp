@@ -0,0 +1,29 @@
+#include <cassert>
+
+#include "half.h"
+
+void to_fp32(float* out, const uint16_t* in, size_t n, dtype type) {
+    assert(type != dtype::f32);
+    if (type == dtype::f16) {
+        for (size_t i = 0 ; i < n ; i++) {
+            out[i] = fp16_to_fp32(in[i]);
+        }
+    } else {
+        for (size_t i = 0 ; i < n ; i++) {
+            out[i] = bf16_to_fp32(in[i]);
+        }
+    }
+}
+
+void from_fp32(uint16_t* out, const float* in, size_t n, dtype type) {
+    assert(type != dtype::f32);
+    if (type == dtype::f16) {
+        for (size_t i = 0 ; i < n ; i++) {
+            out[i] = fp32_to_fp16(in[i]);
+        }
+    } else {
+        for (size_t i = 0 ; i < n ; i++) {
+            out[i] = fp32_to_bf16(in[i]);
+        }
+    }
+}
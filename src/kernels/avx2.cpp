@@ -0,0 +1,138 @@
+#include <cstring>
+#include <immintrin.h>
+
+#include "half.h"
+#include "kernels/kernels.h"
+#include "kernels/fixed.h"
+
+// AVX2 + FMA + F16C kernels, this file is compiled with -mavx2 -mfma -mf16c
+
+static inline float hsum(__m256 v) {
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    lo = _mm_add_ps(lo, hi);
+    lo = _mm_hadd_ps(lo, lo);
+    lo = _mm_hadd_ps(lo, lo);
+    return _mm_cvtss_f32(lo);
+}
+
+static inline __m256 load_f32(const float* p) {
+    return _mm256_loadu_ps(p);
+}
+
+// widen 8 halfs to 8 floats
+static inline __m256 load_f16(const uint16_t* p) {
+    return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)p));
+}
+
+// bf16 is the upper half of an fp32, so widening is a zero extend and a shift
+static inline __m256 load_bf16(const uint16_t* p) {
+    __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(v, 16));
+}
+
+static inline float widen(float v) { return v; }
+static inline float widen_f16(uint16_t v) { return fp16_to_fp32(v); }
+static inline float widen_bf16(uint16_t v) { return bf16_to_fp32(v); }
+
+// x[k] . w[k], with w widened by load/scalar
+template <typename T, __m256 (*load)(const T*), float (*scalar)(T)>
+static inline float dot_row(const float* x, const T* w, int k) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for ( ; i + 16 <= k ; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), load(w + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), load(w + i + 8), acc1);
+    }
+
+    for ( ; i + 8 <= k ; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), load(w + i), acc0);
+    }
+
+    float val = hsum(_mm256_add_ps(acc0, acc1));
+    for ( ; i < k ; i++) {
+        val += x[i] * scalar(w[i]);
+    }
+
+    return val;
+}
+
+template <typename T, __m256 (*load)(const T*), float (*scalar)(T)>
+static void matmul(float* out, const float* x, const T* w, int m, int n, int k) {
+    for (int j = 0 ; j < n ; j++) {
+        for (int i = 0 ; i < m ; i++) {
+            out[i*n + j] = dot_row<T, load, scalar>(x + i*k, w + (size_t)j*k, k);
+        }
+    }
+}
+
+template <typename T, __m256 (*load)(const T*), float (*scalar)(T)>
+static void swiglu_matmul(float* out, const float* x, const T* w, int m, int n, int k) {
+    for (int j = 0 ; j < n ; j++) {
+        for (int i = 0 ; i < m ; i++) {
+            float gate = dot_row<T, load, scalar>(x + i*k, w + (size_t)j*k, k);
+            float up = dot_row<T, load, scalar>(x + i*k, w + (size_t)(n + j)*k, k);
+            out[i*n + j] = swiglu(gate, up);
+        }
+    }
+}
+
+// rows of wt scaled and added up in out, which stays in L1 while the rows stream by
+template <typename T, __m256 (*load)(const T*), float (*scalar)(T)>
+static void sparse_matmul(float* out, const float* x, const T* wt, const int* index, int count, int n) {
+    memset(out, 0, n * sizeof(float));
+    for (int r = 0 ; r < count ; r++) {
+        const __m256 a = _mm256_set1_ps(x[index[r]]);
+        const T* row = wt + (size_t)index[r] * n;
+        int j = 0;
+        for ( ; j + 8 <= n ; j += 8) {
+            _mm256_storeu_ps(out + j, _mm256_fmadd_ps(a, load(row + j), _mm256_loadu_ps(out + j)));
+        }
+
+        for ( ; j < n ; j++) {
+            out[j] += x[index[r]] * scalar(row[j]);
+        }
+    }
+}
+
+static float dot(const float* a, const float* b, int n) {
+    return dot_row<float, load_f32, widen>(a, b, n);
+}
+
+static float sum_squares(const float* x, int n) {
+    return dot_row<float, load_f32, widen>(x, x, n);
+}
+
+static void axpy(float* y, float a, const float* x, int n) {
+    __m256 va = _mm256_set1_ps(a);
+    int i = 0;
+    for ( ; i + 8 <= n ; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+
+    for ( ; i < n ; i++) {
+        y[i] += a * x[i];
+    }
+}
+
+const kernel_table avx2_kernels = {
+    "avx2",
+    isa::avx2,
+    matmul<float, load_f32, widen>,
+    matmul<uint16_t, load_f16, widen_f16>,
+    matmul<uint16_t, load_bf16, widen_bf16>,
+    swiglu_matmul<float, load_f32, widen>,
+    swiglu_matmul<uint16_t, load_f16, widen_f16>,
+    swiglu_matmul<uint16_t, load_bf16, widen_bf16>,
+    sparse_matmul<float, load_f32, widen>,
+    sparse_matmul<uint16_t, load_f16, widen_f16>,
+    sparse_matmul<uint16_t, load_bf16, widen_bf16>,
+    dot,
+    sum_squares,
+    axpy,
+    fixed::rope_for<8>,
+    fixed::attend_for<8>,
+    fixed::attend_paged_for<8>,
+    fixed::rms_norm_for<8>
+};
@@ -0,0 +1,122 @@
+#include <immintrin.h>
+
+#include "half.h"
+#include "kernels/kernels.h"
+#include "kernels/fixed.h"
+
+// AVX-512 kernels, this file is compiled with -mavx512f -mavx512bw -mavx512vl -mfma -mf16c.
+// Tails are handled with masked loads instead of scalar loops.
+
+static inline __m512 load_f32(const float* p, __mmask16 mask) {
+    return _mm512_maskz_loadu_ps(mask, p);
+}
+
+// widen 16 halfs to 16 floats
+static inline __m512 load_f16(const uint16_t* p, __mmask16 mask) {
+    return _mm512_cvtph_ps(_mm256_maskz_loadu_epi16(mask, p));
+}
+
+// bf16 is the upper half of an fp32, so widening is a zero extend and a shift
+static inline __m512 load_bf16(const uint16_t* p, __mmask16 mask) {
+    __m512i v = _mm512_cvtepu16_epi32(_mm256_maskz_loadu_epi16(mask, p));
+    return _mm512_castsi512_ps(_mm512_slli_epi32(v, 16));
+}
+
+static inline __mmask16 tail_mask(int n) {
+    return (__mmask16)((1u << n) - 1);
+}
+
+template <typename T, __m512 (*load)(const T*, __mmask16)>
+static inline float dot_row(const float* x, const T* w, int k) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for ( ; i + 32 <= k ; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), load(w + i, 0xffff), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), load(w + i + 16, 0xffff), acc1);
+    }
+
+    for ( ; i < k ; i += 16) {
+        __mmask16 mask = k - i >= 16 ? 0xffff : tail_mask(k - i);
+        acc0 = _mm512_fmadd_ps(load_f32(x + i, mask), load(w + i, mask), acc0);
+    }
+
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+template <typename T, __m512 (*load)(const T*, __mmask16)>
+static void matmul(float* out, const float* x, const T* w, int m, int n, int k) {
+    for (int j = 0 ; j < n ; j++) {
+        for (int i = 0 ; i < m ; i++) {
+            out[i*n + j] = dot_row<T, load>(x + i*k, w + (size_t)j*k, k);
+        }
+    }
+}
+
+template <typename T, __m512 (*load)(const T*, __mmask16)>
+static void swiglu_matmul(float* out, const float* x, const T* w, int m, int n, int k) {
+    for (int j = 0 ; j < n ; j++) {
+        for (int i = 0 ; i < m ; i++) {
+            float gate = dot_row<T, load>(x + i*k, w + (size_t)j*k, k);
+            float up = dot_row<T, load>(x + i*k, w + (size_t)(n + j)*k, k);
+            out[i*n + j] = swiglu(gate, up);
+        }
+    }
+}
+
+// rows of wt scaled and added up in out, which stays in L1 while the rows stream by
+template <typename T, __m512 (*load)(const T*, __mmask16)>
+static void sparse_matmul(float* out, const float* x, const T* wt, const int* index, int count, int n) {
+    for (int j = 0 ; j < n ; j += 16) {
+        __mmask16 mask = n - j >= 16 ? 0xffff : tail_mask(n - j);
+        _mm512_mask_storeu_ps(out + j, mask, _mm512_setzero_ps());
+    }
+
+    for (int r = 0 ; r < count ; r++) {
+        const __m512 a = _mm512_set1_ps(x[index[r]]);
+        const T* row = wt + (size_t)index[r] * n;
+        for (int j = 0 ; j < n ; j += 16) {
+            __mmask16 mask = n - j >= 16 ? 0xffff : tail_mask(n - j);
+            __m512 acc = _mm512_maskz_loadu_ps(mask, out + j);
+            _mm512_mask_storeu_ps(out + j, mask, _mm512_fmadd_ps(a, load(row + j, mask), acc));
+        }
+    }
+}
+
+static float dot(const float* a, const float* b, int n) {
+    return dot_row<float, load_f32>(a, b, n);
+}
+
+static float sum_squares(const float* x, int n) {
+    return dot_row<float, load_f32>(x, x, n);
+}
+
+static void axpy(float* y, float a, const float* x, int n) {
+    __m512 va = _mm512_set1_ps(a);
+    for (int i = 0 ; i < n ; i += 16) {
+        __mmask16 mask = n - i >= 16 ? 0xffff : tail_mask(n - i);
+        __m512 vy = _mm512_maskz_loadu_ps(mask, y + i);
+        _mm512_mask_storeu_ps(y + i, mask, _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(mask, x + i), vy));
+    }
+}
+
+const kernel_table avx512_kernels = {
+    "avx512",
+    isa::avx512,
+    matmul<float, load_f32>,
+    matmul<uint16_t, load_f16>,
+    matmul<uint16_t, load_bf16>,
+    swiglu_matmul<float, load_f32>,
+    swiglu_matmul<uint16_t, load_f16>,
+    swiglu_matmul<uint16_t, load_bf16>,
+    sparse_matmul<float, load_f32>,
+    sparse_matmul<uint16_t, load_f16>,
+    sparse_matmul<uint16_t, load_bf16>,
+    dot,
+    sum_squares,
+    axpy,
+    fixed::rope_for<16>,
+    fixed::attend_for<16>,
+    fixed::attend_paged_for<16>,
+    fixed::rms_norm_for<16>
+};
@@ -0,0 +1,206 @@
+#ifndef __tinyinference_fixed_h
+#define __tinyinference_fixed_h
+
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+
+#include "dispatch.h"
+
+// Attention, RoPE and rms_norm kernels specialized on the sizes the models we run
+// use. N is the head size (or model dim) as a compile time constant, 0 means it
+// is only known at runtime. With a constant N the compiler fully unrolls and
+// vectorizes the loops. LANES independent accumulators let it vectorize the
+// reductions without reassociating floats; with LANES = 1 the sums are done in
+// order, which the generic table relies on to stay the reference.
+//
+// Included by every kernel translation unit, so each instruction set level gets
+// its own copy compiled with its own flags. Everything here must stay static and
+// stay away from inline library templates, or the linker may merge the copies.
+
+namespace fixed {
+
+const int max_head_size = 512;
+
+template <int N, int LANES>
+static inline float dot(const float* a, const float* b, int n) {
+    const int len = N ? N : n;
+    float acc[LANES] = {};
+    int i = 0;
+    for ( ; i + LANES <= len ; i += LANES) {
+        for (int l = 0 ; l < LANES ; l++) {
+            acc[l] += a[i + l] * b[i + l];
+        }
+    }
+
+    float val = 0.0f;
+    for (int l = 0 ; l < LANES ; l++) {
+        val += acc[l];
+    }
+
+    for ( ; i < len ; i++) {
+        val += a[i] * b[i];
+    }
+
+    return val;
+}
+
+template <int HEAD_SIZE>
+static void rope(float* q, float* k, int dim, int kv_dim, int head_size, int pos) {
+    const int hs = HEAD_SIZE ? HEAD_SIZE : head_size;
+    assert(hs <= max_head_size); // rope_for refuses larger heads
+    float fcr[(HEAD_SIZE ? HEAD_SIZE : max_head_size) / 2];
+    float fci[(HEAD_SIZE ? HEAD_SIZE : max_head_size) / 2];
+
+    // the rotation only depends on the position inside the head, so compute it once for all heads
+    for (int i = 0 ; i < hs ; i += 2) {
+        float freq = 1.0f / powf(10000.0f, i / (float)hs);
+        float val = pos * freq;
+        fcr[i / 2] = cosf(val);
+        fci[i / 2] = sinf(val);
+    }
+
+    // rotate q for every query head, k for every key/value head
+    for (int h = 0 ; h < dim ; h += hs) {
+        for (int i = 0 ; i < hs ; i += 2) {
+            float v0 = q[h + i];
+            float v1 = q[h + i + 1];
+            q[h + i] = v0 * fcr[i / 2] - v1 * fci[i / 2];
+            q[h + i + 1] = v0 * fci[i / 2] + v1 * fcr[i / 2];
+        }
+    }
+
+    for (int h = 0 ; h < kv_dim ; h += hs) {
+        for (int i = 0 ; i < hs ; i += 2) {
+            float v0 = k[h + i];
+            float v1 = k[h + i + 1];
+            k[h + i] = v0 * fcr[i / 2] - v1 * fci[i / 2];
+            k[h + i + 1] = v0 * fci[i / 2] + v1 * fcr[i / 2];
+        }
+    }
+}
+
+// one head of attention over n_pos cached positions, key(t) and value(t) find their rows
+template <int HEAD_SIZE, int LANES, typename KEY, typename VALUE>
+static inline void attend_rows(float* out, const float* q, KEY key, VALUE value, float* att, int n_pos, int head_size) {
+    const int hs = HEAD_SIZE ? HEAD_SIZE : head_size;
+    const float scale = sqrtf(hs);
+
+    // attention scores against every cached key
+    for (int t = 0 ; t < n_pos ; t++) {
+        att[t] = dot<HEAD_SIZE, LANES>(q, key(t), hs) / scale;
+    }
+
+    // softmax the scores in place
+    float max_val = att[0];
+    for (int t = 1 ; t < n_pos ; t++) {
+        max_val = att[t] > max_val ? att[t] : max_val;
+    }
+
+    float sum = 0.0f;
+    for (int t = 0 ; t < n_pos ; t++) {
+        att[t] = expf(att[t] - max_val);
+        sum += att[t];
+    }
+
+    for (int t = 0 ; t < n_pos ; t++) {
+        att[t] /= sum;
+    }
+
+    // weighted sum of the cached values
+    for (int i = 0 ; i < hs ; i++) {
+        out[i] = 0.0f;
+    }
+
+    for (int t = 0 ; t < n_pos ; t++) {
+        const float a = att[t];
+        const float* v = value(t);
+        for (int i = 0 ; i < hs ; i++) {
+            out[i] += a * v[i];
+        }
+    }
+}
+
+template <int HEAD_SIZE, int LANES>
+static void attend(float* out, const float* q, const float* key_cache, const float* value_cache,
+                   int kv_dim, float* att, int n_pos, int head_size) {
+    attend_rows<HEAD_SIZE, LANES>(out, q,
+        [=](int t) { return key_cache + (size_t)t * kv_dim; },
+        [=](int t) { return value_cache + (size_t)t * kv_dim; },
+        att, n_pos, head_size);
+}
+
+template <int HEAD_SIZE, int LANES>
+static void attend_paged(float* out, const float* q, const float* const* key_blocks, const float* const* value_blocks,
+                         int block_size, int kv_dim, float* att, int n_pos, int head_size) {
+    attend_rows<HEAD_SIZE, LANES>(out, q,
+        [=](int t) { return key_blocks[t / block_size] + (size_t)(t % block_size) * kv_dim; },
+        [=](int t) { return value_blocks[t / block_size] + (size_t)(t % block_size) * kv_dim; },
+        att, n_pos, head_size);
+}
+
+template <int DIM, int LANES>
+static void rms_norm(float* out, const float* x, const float* weight, int n, float eps) {
+    const int len = DIM ? DIM : n;
+    float ss = dot<DIM, LANES>(x, x, len);
+    ss /= len;
+    ss += eps;
+    ss = 1.0f / sqrtf(ss);
+
+    for (int i = 0 ; i < len ; i++) {
+        out[i] = weight[i] * (x[i] * ss);
+    }
+}
+
+// pick the specialization for the runtime size, falling back to the generic one
+
+template <int LANES>
+static rope_fn rope_for(int head_size) {
+    switch (head_size) {
+        case 48: return rope<48>;
+        case 64: return rope<64>;
+        case 128: return rope<128>;
+    }
+
+    // the generic rope keeps the rotation of one head on the stack
+    if (head_size > max_head_size) {
+        throw std::runtime_error("rope: head size larger than 512 is not supported");
+    }
+
+    return rope<0>;
+}
+
+template <int LANES>
+static attend_fn attend_for(int head_size) {
+    switch (head_size) {
+        case 48: return attend<48, LANES>;
+        case 64: return attend<64, LANES>;
+        case 128: return attend<128, LANES>;
+        default: return attend<0, LANES>;
+    }
+}
+
+template <int LANES>
+static attend_paged_fn attend_paged_for(int head_size) {
+    switch (head_size) {
+        case 48: return attend_paged<48, LANES>;
+        case 64: return attend_paged<64, LANES>;
+        case 128: return attend_paged<128, LANES>;
+        default: return attend_paged<0, LANES>;
+    }
+}
+
+template <int LANES>
+static rms_norm_fn rms_norm_for(int dim) {
+    switch (dim) {
+        case 288: return rms_norm<288, LANES>;
+        case 512: return rms_norm<512, LANES>;
+        case 768: return rms_norm<768, LANES>;
+        case 4096: return rms_norm<4096, LANES>;
+        default: return rms_norm<0, LANES>;
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,122 @@
+#include "half.h"
+#include "kernels/kernels.h"
+#include "kernels/fixed.h"
+
+// plain C++ reference kernels, summing in order
+
+static float dot(const float* a, const float* b, int n) {
+    float val = 0.0f;
+    for (int i = 0 ; i < n ; i++) {
+        val += a[i] * b[i];
+    }
+
+    return val;
+}
+
+static float sum_squares(const float* x, int n) {
+    float ss = 0.0f;
+    for (int i = 0 ; i < n ; i++) {
+        ss += x[i] * x[i];
+    }
+
+    return ss;
+}
+
+static void axpy(float* y, float a, const float* x, int n) {
+    for (int i = 0 ; i < n ; i++) {
+        y[i] += a * x[i];
+    }
+}
+
+static void generic_matmul_f32(float* out, const float* x, const float* w, int m, int n, int k) {
+    for (int j = 0 ; j < n ; j++) {
+        for (int i = 0 ; i < m ; i++) {
+            out[i*n + j] = dot(x + i*k, w + (size_t)j*k, k);
+        }
+    }
+}
+
+static float dot_f16(const float* x, const uint16_t* row, int k) {
+    float val = 0.0f;
+    for (int l = 0 ; l < k ; l++) {
+        val += x[l] * fp16_to_fp32(row[l]);
+    }
+
+    return val;
+}
+
+static float dot_bf16(const float* x, const uint16_t* row, int k) {
+    float val = 0.0f;
+    for (int l = 0 ; l < k ; l++) {
+        val += x[l] * bf16_to_fp32(row[l]);
+    }
+
+    return val;
+}
+
+static void generic_matmul_f16(float* out, const float* x, const uint16_t* w, int m, int n, int k) {
+    for (int j = 0 ; j < n ; j++) {
+        for (int i = 0 ; i < m ; i++) {
+            out[i*n + j] = dot_f16(x + i*k, w + (size_t)j*k, k);
+        }
+    }
+}
+
+static void generic_matmul_bf16(float* out, const float* x, const uint16_t* w, int m, int n, int k) {
+    for (int j = 0 ; j < n ; j++) {
+        for (int i = 0 ; i < m ; i++) {
+            out[i*n + j] = dot_bf16(x + i*k, w + (size_t)j*k, k);
+        }
+    }
+}
+
+template <typename T, float (*row_dot)(const float*, const T*, int)>
+static void generic_swiglu(float* out, const float* x, const T* w, int m, int n, int k) {
+    for (int j = 0 ; j < n ; j++) {
+        for (int i = 0 ; i < m ; i++) {
+            float gate = row_dot(x + i*k, w + (size_t)j*k, k);
+            float up = row_dot(x + i*k, w + (size_t)(n + j)*k, k);
+            out[i*n + j] = swiglu(gate, up);
+        }
+    }
+}
+
+static float widen(float v) { return v; }
+static float widen_f16(uint16_t v) { return fp16_to_fp32(v); }
+static float widen_bf16(uint16_t v) { return bf16_to_fp32(v); }
+
+template <typename T, float (*scalar)(T)>
+static void generic_sparse_matmul(float* out, const float* x, const T* wt, const int* index, int count, int n) {
+    for (int j = 0 ; j < n ; j++) {
+        out[j] = 0.0f;
+    }
+
+    for (int r = 0 ; r < count ; r++) {
+        const float a = x[index[r]];
+        const T* row = wt + (size_t)index[r] * n;
+        for (int j = 0 ; j < n ; j++) {
+            out[j] += a * scalar(row[j]);
+        }
+    }
+}
+
+const kernel_table generic_kernels = {
+    "generic",
+    isa::generic,
+    generic_matmul_f32,
+    generic_matmul_f16,
+    generic_matmul_bf16,
+    generic_swiglu<float, dot>,
+    generic_swiglu<uint16_t, dot_f16>,
+    generic_swiglu<uint16_t, dot_bf16>,
+    generic_sparse_matmul<float, widen>,
+    generic_sparse_matmul<uint16_t, widen_f16>,
+    generic_sparse_matmul<uint16_t, widen_bf16>,
+    dot,
+    sum_squares,
+    axpy,
+    fixed::rope_for<1>,
+    fixed::attend_for<1>,
+    fixed::attend_paged_for<1>,
+    fixed::rms_norm_for<1>
+};
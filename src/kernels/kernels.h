@@ -0,0 +1,22 @@
+#ifndef __tinyinference_kernels_h
+#define __tinyinference_kernels_h
+
+#include <cmath>
+
+#include "dispatch.h"
+
+// SwiGLU epilogue of the fused gate/up matmul: silu(gate) * up. Static so every
+// kernel translation unit keeps its own copy.
+static inline float swiglu(float gate, float up) {
+    return gate * (1.0f / (1.0f + expf(-gate))) * up;
+}
+
+// one table per translation unit, each compiled for its own instruction set
+extern const kernel_table generic_kernels;
+
+#ifdef TINYINFERENCE_X86_KERNELS
+extern const kernel_table avx2_kernels;
+extern const kernel_table avx512_kernels;
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "lora.h"
+
+int lora_bank::create() {
+    for (size_t i = 0 ; i < live.size() ; i++) {
+        if (!live[i]) {
+            live[i] = true;
+            return i;
+        }
+    }
+
+    adapters.emplace_back();
+    live.push_back(true);
+    return adapters.size() - 1;
+}
+
+void lora_bank::release(int adapter) {
+    if (adapter < 0 || adapter >= (int)adapters.size() || !live[adapter]) {
+        throw std::runtime_error("lora_bank: no such adapter");
+    }
+
+    adapters[adapter].clear();
+    live[adapter] = false;
+}
+
+void lora_bank::set(int adapter, int slot, tensor a, tensor b, float scale) {
+    if (adapter < 0 || adapter >= (int)adapters.size() || !live[adapter] || slot < 0) {
+        throw std::runtime_error("lora_bank: no such adapter");
+    }
+
+    if (a.type() != dtype::f32 || b.type() != dtype::f32 || b.columns() != a.rows()) {
+        throw std::runtime_error("lora_bank: A and B are not a fp32 low-rank pair");
+    }
+
+    if ((int)a.rows() > max_supported_rank) {
+        throw std::runtime_error("lora_bank: rank larger than 1024 is not supported");
+    }
+
+    std::vector<pair>& slots = adapters[adapter];
+    if ((int)slots.size() <= slot) {
+        slots.resize(slot + 1);
+    }
+
+    slots[slot] = pair{std::move(a), std::move(b), scale};
+}
+
+const lora_bank::pair* lora_bank::find(int adapter, int slot) const {
+    if (adapter < 0 || adapter >= (int)adapters.size() || slot >= (int)adapters[adapter].size()) {
+        return nullptr;
+    }
+
+    const pair& p = adapters[adapter][slot];
+    return p.a.size() > 0 ? &p : nullptr;
+}
+
+int lora_bank::size() const {
+    return std::count(live.begin(), live.end(), true);
+}
+
+int lora_bank::max_rank() const {
+    int rank = 0;
+    for (const std::vector<pair>& slots : adapters) {
+        for (const pair& p : slots) {
+            rank = std::max(rank, (int)p.a.rows());
+        }
+    }
+
+    return rank;
+}
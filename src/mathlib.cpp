@@ -3,26 +3,14 @@
 #include <cmath>
 
 #include "mathlib.h"
+#include "dispatch.h"
 
 tensor rms_norm(const tensor& x, const tensor& weight, const float eps) {
     // calculate sum of squares
     assert(x.shape() == weight.shape());
 
-    float ss = 0.0f;
-    std::pair<int, int> dim = x.shape();
-    
-    for (int i = 0 ; i < dim.first ; i++) {
-        for (int j = 0 ; j < dim.second ; j++) {
-            ss += (x[{i,j}] * x[{i,j}]);
-        }
-    }
-
-    ss /= (dim.first * dim.second);
-    ss += eps;
-    ss = 1.0f / sqrtf(ss);
-
-    //normalize and scale
-    tensor result = weight * (x * ss);
+    tensor result{x.shape()};
+    kernels().rms_norm_for(x.size())(result.get_data(), x.get_data(), weight.get_data(), x.size(), eps);
     return result;
 }
 
@@ -51,18 +39,18 @@ tensor softmax(const tensor& x) {
     return res;
 }
 
-tensor sigmoid(const tensor& t) {
-    tensor x = t;
-    for (int i = 0 ; i < x.shape().first; i++) {
-        for (int j = 0 ; j < x.shape().second ; j++) {
-            x[{i, j}] = 1.0f / (1.0f + expf(-x[{i, j}]));
-        }
+tensor swiglu(const tensor& x, const tensor& w) {
+    assert(x.type() == dtype::f32 && x.columns() == w.columns() && w.rows() % 2 == 0);
+    const int m = x.rows();
+    const int n = w.rows() / 2;
+    const int k = x.columns();
+
+    tensor result{{m, n}};
+    switch (w.type()) {
+        case dtype::f16: kernels().swiglu_f16(result.get_data(), x.get_data(), w.get_half_data(), m, n, k); break;
+        case dtype::bf16: kernels().swiglu_bf16(result.get_data(), x.get_data(), w.get_half_data(), m, n, k); break;
+        default: kernels().swiglu_f32(result.get_data(), x.get_data(), w.get_data(), m, n, k);
     }
 
-    return x;
+    return result;
 }
-
-tensor silu(const tensor& x) {
-    tensor res = x * sigmoid(x);
-    return res;
-}
\ No newline at end of file
@@ -0,0 +1,94 @@
+#include <atomic>
+
+#include "memory.h"
+
+namespace memory {
+
+struct counters {
+    std::atomic<size_t> live{0};
+    std::atomic<size_t> peak{0};
+    std::atomic<size_t> allocations{0};
+};
+
+static counters per_category[(int)category::count];
+static counters all;
+
+static thread_local category current_category = category::activations;
+
+static void raise_peak(std::atomic<size_t>& peak, size_t live) {
+    size_t seen = peak.load(std::memory_order_relaxed);
+    while (live > seen && !peak.compare_exchange_weak(seen, live, std::memory_order_relaxed)) {}
+}
+
+static void add(counters& c, size_t bytes) {
+    size_t live = c.live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    c.allocations.fetch_add(1, std::memory_order_relaxed);
+    raise_peak(c.peak, live);
+}
+
+const char* name(category c) {
+    switch (c) {
+        case category::weights: return "weights";
+        case category::kv_cache: return "kv_cache";
+        case category::activations: return "activations";
+        case category::sampler: return "sampler";
+        default: return "other";
+    }
+}
+
+void on_allocate(category c, size_t bytes) {
+    add(per_category[(int)c], bytes);
+    add(all, bytes);
+}
+
+void on_release(category c, size_t bytes) {
+    per_category[(int)c].live.fetch_sub(bytes, std::memory_order_relaxed);
+    all.live.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+static stats snapshot(const counters& c) {
+    return {c.live.load(std::memory_order_relaxed), c.peak.load(std::memory_order_relaxed),
+            c.allocations.load(std::memory_order_relaxed)};
+}
+
+stats get(category c) {
+    return snapshot(per_category[(int)c]);
+}
+
+stats total() {
+    return snapshot(all);
+}
+
+void reset_peak() {
+    for (counters& c : per_category) {
+        c.peak.store(c.live.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    all.peak.store(all.live.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+void print_report(FILE* out) {
+    const double mb = 1024.0 * 1024.0;
+    fprintf(out, "%-12s %12s %12s %12s\n", "memory", "live MB", "peak MB", "allocs");
+    for (int i = 0 ; i < (int)category::count ; i++) {
+        stats s = get((category)i);
+        fprintf(out, "%-12s %12.2f %12.2f %12zu\n", name((category)i), s.live_bytes / mb, s.peak_bytes / mb, s.allocations);
+    }
+
+    stats s = total();
+    fprintf(out, "%-12s %12.2f %12.2f %12zu\n", "total", s.live_bytes / mb, s.peak_bytes / mb, s.allocations);
+}
+
+category current() {
+    return current_category;
+}
+
+scope::scope(category c) : previous{current_category} {
+    current_category = c;
+}
+
+scope::~scope() {
+    current_category = previous;
+}
+
+}
@@ -2,6 +2,7 @@
 
 embedding::embedding () : tensor() {}
 embedding::embedding (float* data, int vocab_size, int embd_dim) : tensor{data, {vocab_size, embd_dim}, true} {}
+embedding::embedding (void* data, int vocab_size, int embd_dim, dtype type) : tensor{data, {vocab_size, embd_dim}, type} {}
 embedding::embedding (int vocab_size, int embd_dim) : tensor({vocab_size, embd_dim}) {}
 
 int embedding::embedding_size() const {
@@ -12,7 +13,13 @@ int embedding::vocab_size() const {
     return tensor::rows();
 }
 
-tensor& embedding::operator() (size_t token) const {
-    tensor* res = new tensor(m_data + token * dim.second, {1, dim.second}, true);
-    return *res;
+tensor embedding::operator() (size_t token) const {
+    if (m_type != dtype::f32) {
+        // half precision table: hand out the row widened to fp32
+        tensor res({1, dim.second});
+        to_fp32(res.get_data(), m_half + token * dim.second, dim.second, m_type);
+        return res;
+    }
+
+    return tensor(m_data + token * dim.second, {1, dim.second});
 }
\ No newline at end of file
@@ -0,0 +1,137 @@
+#include <cstring>
+#include <stdexcept>
+
+#include "memory.h"
+#include "paged_kv_cache.h"
+
+paged_kv_cache::paged_kv_cache(int n_layers, int kv_dim, int block_size, int n_blocks)
+: n_layers{n_layers}, kv_dim{kv_dim}, block_size{block_size}, refs(n_blocks, 0) {
+    if (n_layers <= 0 || kv_dim <= 0 || block_size <= 0 || n_blocks <= 0) {
+        throw std::runtime_error("paged_kv_cache: empty cache");
+    }
+
+    keys.resize(n_blocks);
+    values.resize(n_blocks);
+
+    // handed out from the back, so the first blocks go first
+    for (int b = n_blocks - 1 ; b >= 0 ; b--) {
+        free_blocks.push_back(b);
+    }
+}
+
+float* paged_kv_cache::row(const std::vector<tensor>& blocks, int block, int layer, int offset) const {
+    return blocks[block].get_data() + ((size_t)layer * block_size + offset) * kv_dim;
+}
+
+int paged_kv_cache::blocks_allocated() const {
+    int count = 0;
+    for (const tensor& block : keys) {
+        count += block.size() > 0;
+    }
+
+    return count;
+}
+
+int paged_kv_cache::allocate_block() {
+    if (free_blocks.empty()) {
+        throw std::runtime_error("paged_kv_cache: out of blocks");
+    }
+
+    int b = free_blocks.back();
+    free_blocks.pop_back();
+    refs[b] = 1;
+    if (keys[b].size() == 0) {
+        memory::scope kv{memory::category::kv_cache};
+        keys[b] = tensor{{n_layers * block_size, kv_dim}};
+        values[b] = tensor{{n_layers * block_size, kv_dim}};
+    }
+
+    return b;
+}
+
+void paged_kv_cache::check(int seq) const {
+    if (seq < 0 || seq >= (int)tables.size() || !live[seq]) {
+        throw std::runtime_error("paged_kv_cache: no such sequence");
+    }
+}
+
+int paged_kv_cache::create() {
+    for (size_t s = 0 ; s < live.size() ; s++) {
+        if (!live[s]) {
+            live[s] = true;
+            tables[s].clear();
+            return s;
+        }
+    }
+
+    tables.emplace_back();
+    live.push_back(true);
+    return tables.size() - 1;
+}
+
+int paged_kv_cache::fork(int seq) {
+    check(seq);
+    int child = create();
+    tables[child] = tables[seq];
+    for (int b : tables[child]) {
+        refs[b]++;
+    }
+
+    return child;
+}
+
+void paged_kv_cache::release(int seq) {
+    check(seq);
+    for (int b : tables[seq]) {
+        if (--refs[b] == 0) {
+            free_blocks.push_back(b);
+        }
+    }
+
+    tables[seq].clear();
+    live[seq] = false;
+}
+
+void paged_kv_cache::reserve(int seq, int pos) {
+    check(seq);
+    std::vector<int>& table = tables[seq];
+    size_t index = pos / block_size;
+    if (pos < 0 || index > table.size()) {
+        throw std::runtime_error("paged_kv_cache: positions must be written in order");
+    }
+
+    if (index == table.size()) {
+        table.push_back(allocate_block());
+        return;
+    }
+
+    int shared = table[index];
+    if (refs[shared] == 1) {
+        return;
+    }
+
+    // copy on write, every layer of the positions already there
+    int own = allocate_block();
+    size_t floats = (size_t)n_layers * block_size * kv_dim;
+    memcpy(keys[own].get_data(), keys[shared].get_data(), floats * sizeof(float));
+    memcpy(values[own].get_data(), values[shared].get_data(), floats * sizeof(float));
+    refs[shared]--;
+    table[index] = own;
+}
+
+float* paged_kv_cache::key(int layer, int seq, int pos) {
+    return row(keys, tables[seq][pos / block_size], layer, pos % block_size);
+}
+
+float* paged_kv_cache::value(int layer, int seq, int pos) {
+    return row(values, tables[seq][pos / block_size], layer, pos % block_size);
+}
+
+void paged_kv_cache::blocks(int layer, int seq, int n_pos, const float** key_blocks, const float** value_blocks) const {
+    check(seq);
+    int n_blocks = (n_pos + block_size - 1) / block_size;
+    for (int i = 0 ; i < n_blocks ; i++) {
+        key_blocks[i] = row(keys, tables[seq][i], layer, 0);
+        value_blocks[i] = row(values, tables[seq][i], layer, 0);
+    }
+}
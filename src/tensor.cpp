@@ -4,6 +4,8 @@
 #include <sstream>
 
 #include "tensor.h"
+#include "dispatch.h"
+#include "memory.h"
 
 tensor::tensor() : ref{true}, m_data{nullptr} {
     dim = {0,0};
@@ -16,49 +18,89 @@ tensor::tensor(float* data, std::pair<int, int> dim)
 
 tensor::tensor(float* data, std::pair<int, int> dim, bool ref) 
 : ref{ref}, m_data{data}, dim{dim} {
-    //this->ref = ref;
+    if (!ref) {
+        // adopting a new[] buffer, charge it like our own allocations
+        m_category = memory::current();
+        memory::on_allocate(m_category, bytes());
+    }
+}
+
+tensor::tensor(void* data, std::pair<int, int> dim, dtype type)
+: ref{true}, m_data{nullptr}, dim{dim}, m_type{type} {
+    if (type == dtype::f32) {
+        m_data = (float*)data;
+    } else {
+        m_half = (uint16_t*)data;
+    }
 }
 
 tensor::tensor(std::pair<int, int> dim, float val)
-: ref{false}, m_data{nullptr}, dim{dim}  {
-    m_data = new float[dim.first * dim.second];
+: ref{true}, m_data{nullptr}, dim{dim}  {
+    allocate();
     std::fill_n(m_data, (dim.first * dim.second), val);
-    //this->ref = false;
 }
 
 tensor::tensor(std::pair<int, int> dim) 
-: ref{false}, m_data{nullptr}, dim{dim} {
-    m_data = new float[dim.first * dim.second];
+: ref{true}, m_data{nullptr}, dim{dim} {
+    allocate();
+}
+
+tensor::tensor(std::pair<int, int> dim, dtype type)
+: ref{true}, m_data{nullptr}, dim{dim}, m_type{type} {
+    allocate();
 }
 
 tensor::tensor(const tensor& t)
-: ref{false}, m_data{nullptr} {
-    m_data = new float[t.size()];
-    dim = t.shape();
-    memcpy(m_data, t.m_data, t.size() * sizeof(float));
-    //this->ref = false;
+: ref{true}, m_data{nullptr}, dim{t.dim}, m_type{t.m_type} {
+    allocate();
+    memcpy(m_type == dtype::f32 ? (void*)m_data : (void*)m_half, t.raw(), t.bytes());
 }
 
 tensor::tensor(tensor&& matrix) {
     m_data = matrix.get_data();
+    m_half = matrix.m_half;
+    m_type = matrix.m_type;
+    m_category = matrix.m_category;
     dim = matrix.shape();
+    // the new tensor takes over the ownership, the old one is left as a plain reference
+    ref = matrix.ref;
     matrix.ref = true;
 }
 
 tensor::~tensor() {
-    if (!ref && m_data != nullptr) {
-        delete[] m_data;
+    release();
+}
+
+void tensor::allocate() {
+    m_category = memory::current();
+    memory::on_allocate(m_category, bytes());
+    if (m_type == dtype::f32) {
+        m_data = new float[size()];
+    } else {
+        m_half = new uint16_t[size()];
     }
+
+    ref = false;
 }
 
-void tensor::set_data(float* data, int size) {
-    assert(this->size() == size);
-    m_data = data;
+void tensor::release() {
+    if (ref) {
+        return;
+    }
+
+    memory::on_release(m_category, bytes());
+    delete[] m_data;
+    delete[] m_half;
+    m_data = nullptr;
+    m_half = nullptr;
     ref = true;
 }
 
-void tensor::set_ref(bool ref) {
-    this->ref = ref;
+void tensor::set_data(float* data, int size) {
+    assert(this->size() == size);
+    release();
+    m_type = dtype::f32;
+    m_data = data;
 }
 
 void tensor::set_shape(std::pair<int,int> n_dim) {
@@ -70,7 +112,14 @@ std::string tensor::toString() const {
     std::stringstream ss;
     for(int i = 0; i < dim.first; i++) {
         for(int j = 0; j < dim.second; j++) {
-            ss << std::setprecision(2) << m_data[i*dim.second+j] << " ";
+            float val;
+            switch (m_type) {
+                case dtype::f16: val = fp16_to_fp32(m_half[i*dim.second+j]); break;
+                case dtype::bf16: val = bf16_to_fp32(m_half[i*dim.second+j]); break;
+                default: val = m_data[i*dim.second+j];
+            }
+
+            ss << std::setprecision(2) << val << " ";
         }
 
         ss << std::endl;
@@ -80,107 +129,98 @@ std::string tensor::toString() const {
 }
 
 float& tensor::operator[] (std::pair<size_t, size_t> index) const {
+    assert(m_type == dtype::f32);
     assert((index.first < dim.first) && (index.second < dim.second));
     return m_data[index.first * dim.second + index.second];
 }
 
-tensor& tensor::operator[] (size_t index) const {
+tensor tensor::operator[] (size_t index) const {
     assert(index < dim.first);
-    tensor* res = new tensor(m_data + (index * dim.second), {1, dim.second}, true);
-    return *res;
+    if (m_type != dtype::f32) {
+        return tensor(m_half + (index * dim.second), {1, dim.second}, m_type);
+    }
+
+    return tensor(m_data + (index * dim.second), {1, dim.second});
 }
 
 float& tensor::operator() (std::pair<size_t, size_t> index) const {
+    assert(m_type == dtype::f32);
     assert((index.first < dim.first) && (index.second < dim.second));
     return m_data[index.first * dim.second + index.second];
 }
 
-tensor& tensor::operator() (size_t index) const {
-    assert(index < dim.first);
-    tensor* res = new tensor(m_data + (index * dim.second), {1, dim.second}, true);
-    return *res;
+tensor tensor::operator() (size_t index) const {
+    return (*this)[index];
 }
 
-tensor tensor::operator+(const tensor& obj) const {
-    assert(this->shape() == obj.shape());
-    tensor res = *this;
-    for (int i = 0 ; i < dim.first ; i++) {
-        for (int j = 0 ; j < dim.second ; j++) {
-            res[{i,j}] += obj[{i,j}];
-        }
+namespace expression {
+
+void product::matmul_into(float* out) const {
+    assert(x->type() == dtype::f32);
+    const int m = x->rows();
+    const int n = w->rows();
+    const int k = x->columns();
+    switch (w->type()) {
+        // half precision weights are widened to fp32 by the kernel
+        case dtype::f16: matmul_f16(out, x->get_data(), w->get_half_data(), m, n, k); break;
+        case dtype::bf16: matmul_bf16(out, x->get_data(), w->get_half_data(), m, n, k); break;
+        default: kernels().matmul_f32(out, x->get_data(), w->get_data(), m, n, k);
     }
-
-    return res;
 }
 
-tensor tensor::operator*(const tensor& obj) const {
-    assert((this->shape() == obj.shape()) || (dim.second == obj.shape().second));
-    if (this->shape() == obj.shape()) {
-        //dot product
-        tensor res = *this;
-        for (int i = 0 ; i < dim.first ; i++) {
-            for (int j = 0 ; j < dim.second ; j++) {
-                res[{i,j}] *= obj[{i,j}];
-            }
+void evaluate(float* out, const product& p) {
+    if (!p.is_matmul() || out == p.x->get_data()) {
+        // elementwise, or x = x * w which must not overwrite x while it is read
+        p.prepare();
+        const std::pair<int, int> dim = p.shape();
+        const size_t n = (size_t)dim.first * dim.second;
+        for (size_t i = 0 ; i < n ; i++) {
+            out[i] = p.at(i);
         }
 
-        return res;
-    } else if (dim.second == obj.shape().second) {
-        tensor res{{dim.first, obj.shape().first}};
-        for (int i = 0 ; i < dim.first ; i++) {
-            for (int j = 0 ; j < obj.shape().first ; j++) {
-                float val = 0.0f;
-                for (int k = 0 ; k < dim.second ; k++) {
-                    val += m_data[i*dim.second + k] * obj.m_data[j*dim.second + k];
-                }
-
-                res[{i, j}] = val;
-            }
-        }
-
-        return res;
-    } else {
-        throw std::runtime_error("Matrix dimensions are not compatible.");
+        return;
     }
-}
 
-tensor tensor::operator*(const float& val) const {
-    tensor res = *this;
-    for (int i = 0 ; i < dim.first ; i++) {
-        for (int j = 0 ; j < dim.second ; j++) {
-            res[{i,j}] *= val;
-        }
-    }
+    p.matmul_into(out);
+}
 
-    return res;
 }
 
 tensor& tensor::operator=(const tensor& matrix) {
-	if (this != &matrix) {
-		if (!ref && m_data != nullptr) {
-            delete[] m_data;
+    if (this != &matrix) {
+        if (ref && raw() != nullptr && this->size() == matrix.size() && m_type == matrix.m_type) {
+            // assigning to a reference writes through, the memory still belongs to someone else
+            memcpy(m_type == dtype::f32 ? (void*)m_data : (void*)m_half, matrix.raw(), matrix.bytes());
+        } else {
+            // anything else gets its own copy
+            release();
+            m_data = nullptr;
+            m_half = nullptr;
+            m_type = matrix.m_type;
+            dim = matrix.dim;
+            allocate();
+            memcpy(m_type == dtype::f32 ? (void*)m_data : (void*)m_half, matrix.raw(), matrix.bytes());
         }
-		
-		m_data = matrix.m_data;
-	    dim = matrix.dim;
-	}
-	
+    }
+
     return *this;
 }
 
 tensor& tensor::operator=(tensor&& matrix) {
     if (this != &matrix) {
-        if (ref && this->size() == matrix.size()) {
+        if (ref && m_data != nullptr && this->size() == matrix.size() && m_type == dtype::f32 && matrix.m_type == dtype::f32) {
+            // assigning to a reference writes through, the memory still belongs to someone else
             memcpy(m_data, matrix.m_data, sizeof(float) * dim.first * dim.second);
-            ref = false;
         } else {
-            if (!ref && m_data != nullptr) {
-                delete[] m_data;
-            }
-            
+            release();
             m_data = matrix.m_data;
-            matrix.m_data = nullptr;
+            m_half = matrix.m_half;
+            m_type = matrix.m_type;
+            m_category = matrix.m_category;
             ref = matrix.ref;
+            matrix.m_data = nullptr;
+            matrix.m_half = nullptr;
+            matrix.ref = true;
         }
 
         dim = matrix.dim;
@@ -189,10 +229,38 @@ tensor& tensor::operator=(tensor&& matrix) {
     return *this;
 }
 
-tensor tensor::copy() {
-    float* m_data_copy = new float[this->size()];
-    memcpy(m_data_copy, m_data, this->size() * sizeof(float));
+tensor tensor::copy() const {
+    return tensor{*this};
+}
+
+tensor tensor::to(dtype type) const {
+    if (type == m_type) {
+        if (m_type == dtype::f32) {
+            return tensor{m_data, dim, true};
+        }
+
+        return tensor{m_half, dim, m_type};
+    }
+
+    if (type == dtype::f32) {
+        tensor res{dim};
+        to_fp32(res.m_data, m_half, size(), m_type);
+        return res;
+    }
 
-    tensor new_t{m_data_copy, this->dim, false};
-    return new_t;
+    tensor res;
+    res.dim = dim;
+    res.m_type = type;
+    res.allocate();
+    if (m_type == dtype::f32) {
+        from_fp32(res.m_half, m_data, size(), type);
+    } else {
+        // between the two half types, go through fp32
+        for (size_t i = 0 ; i < size() ; i++) {
+            float val = m_type == dtype::f16 ? fp16_to_fp32(m_half[i]) : bf16_to_fp32(m_half[i]);
+            res.m_half[i] = type == dtype::f16 ? fp32_to_fp16(val) : fp32_to_bf16(val);
+        }
+    }
+
+    return res;
 }
\ No newline at end of file
@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "trace.h"
+
+namespace trace {
+
+struct ring {
+    std::vector<event> events;
+    size_t next = 0;
+    bool wrapped = false;
+    int tid;
+};
+
+static std::mutex rings_mutex;
+static std::vector<ring*> rings; // never freed, so events survive their thread
+static size_t capacity = 1 << 16;
+
+static uint64_t read_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// (ticks, steady clock) taken at startup, to convert ticks to wall time on export
+static const std::chrono::steady_clock::time_point origin_time = std::chrono::steady_clock::now();
+static const uint64_t origin_ticks = read_ticks();
+
+static ring* register_thread() {
+    ring* r = new ring;
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    r->events.resize(capacity);
+    r->tid = rings.size() + 1;
+    rings.push_back(r);
+    return r;
+}
+
+static ring* local_ring() {
+    thread_local ring* r = register_thread();
+    return r;
+}
+
+uint64_t now() {
+    return read_ticks();
+}
+
+void record(const char* name, int arg, uint64_t start, uint64_t end) {
+    ring* r = local_ring();
+    r->events[r->next] = {name, arg, start, end};
+    if (++r->next == r->events.size()) {
+        r->next = 0;
+        r->wrapped = true;
+    }
+}
+
+void set_capacity(size_t events) {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    capacity = std::max<size_t>(events, 1);
+    for (ring* r : rings) {
+        r->events.assign(capacity, {});
+        r->next = 0;
+        r->wrapped = false;
+    }
+}
+
+void clear() {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    for (ring* r : rings) {
+        r->next = 0;
+        r->wrapped = false;
+    }
+}
+
+// ticks per microsecond, measured over the lifetime of the trace
+static double ticks_per_us() {
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin_time).count();
+    double ticks = (double)(read_ticks() - origin_ticks);
+    return (us > 0.0 && ticks > 0.0) ? ticks / us : 1000.0;
+}
+
+// every recorded event of every thread, oldest first per thread
+template <typename F>
+static void for_each_event(F fn) {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    for (ring* r : rings) {
+        size_t count = r->wrapped ? r->events.size() : r->next;
+        size_t first = r->wrapped ? r->next : 0;
+        for (size_t i = 0 ; i < count ; i++) {
+            fn(r->tid, r->events[(first + i) % r->events.size()]);
+        }
+    }
+}
+
+bool write_chrome_trace(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        return false;
+    }
+
+    double scale = ticks_per_us();
+    bool first = true;
+    fprintf(out, "{\"traceEvents\": [\n");
+    for_each_event([&](int tid, const event& e) {
+        fprintf(out, "%s  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+                first ? "" : ",\n", e.name, tid, (double)(e.start - origin_ticks) / scale,
+                (double)(e.end - e.start) / scale);
+        if (e.arg >= 0) {
+            fprintf(out, ", \"args\": {\"layer\": %d}", e.arg);
+        }
+
+        fprintf(out, "}");
+        first = false;
+    });
+    fprintf(out, "\n], \"displayTimeUnit\": \"ms\"}\n");
+    return fclose(out) == 0;
+}
+
+void print_summary(FILE* out) {
+    struct stats {
+        long count = 0;
+        double total = 0.0;
+        double min = 0.0;
+        double max = 0.0;
+    };
+
+    double scale = ticks_per_us();
+    std::map<std::string, stats> ops;
+    uint64_t first_tick = UINT64_MAX;
+    uint64_t last_tick = 0;
+    for_each_event([&](int, const event& e) {
+        double us = (double)(e.end - e.start) / scale;
+        stats& s = ops[e.name];
+        s.min = s.count == 0 ? us : std::min(s.min, us);
+        s.max = std::max(s.max, us);
+        s.total += us;
+        s.count++;
+        first_tick = std::min(first_tick, e.start);
+        last_tick = std::max(last_tick, e.end);
+    });
+
+    if (ops.empty()) {
+        fprintf(out, "trace: no events recorded\n");
+        return;
+    }
+
+    // biggest total first
+    std::vector<std::pair<std::string, stats>> sorted(ops.begin(), ops.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+        return a.second.total > b.second.total;
+    });
+
+    double span = (double)(last_tick - first_tick) / scale;
+    fprintf(out, "%-20s %10s %12s %10s %10s %10s %7s\n", "op", "count", "total ms", "mean us", "min us", "max us", "% span");
+    for (const auto& op : sorted) {
+        const stats& s = op.second;
+        fprintf(out, "%-20s %10ld %12.3f %10.2f %10.2f %10.2f %6.1f%%\n", op.first.c_str(), s.count,
+                s.total / 1000.0, s.total / s.count, s.min, s.max, span > 0.0 ? 100.0 * s.total / span : 0.0);
+    }
+}
+
+}